@@ -0,0 +1,352 @@
+//microbenchmarks of the scheduler's queues and tick, run with "make bench"
+//the scheduler is compiled in with its main renamed (as dummy_main.h does for the test programs),
+//so the benchmarks call the same functions the daemon runs, on mock jobs and sleeping children
+//output is csv on stdout: benchmark,depth,ncpu,workers,ops,ns_per_op
+#define main scheduler_main
+#include "simpleScheduler.c"
+#undef main
+
+#define BENCH_DEPTHS 5
+#define BENCH_NCPUS 4
+#define BENCH_OPS 200000 //operations of the queue benchmarks
+#define BENCH_SCANS 2000 //admission scans per table size
+#define BENCH_TICKS 200 //ticks per cpu count
+
+const int bench_depths[BENCH_DEPTHS] = {64, 256, 1024, 4096, 16384};
+const int bench_ncpus[BENCH_NCPUS] = {4, 16, 64, 128};
+const int scan_depths[BENCH_DEPTHS] = {16, 64, 250, 500, 1000};
+int bench_workers = 1;
+
+//function declarations
+long now_ns();
+void report(char *name, int depth, int ncpu, long ops, long ns);
+struct pqueue *new_pqueue(int capacity);
+void free_running_queue();
+void bench_pqueue(int depth);
+void bench_queue(int ncpu);
+void bench_admission(int depth);
+void bench_mutex();
+void bench_tick(int ncpu);
+void wait_state(struct Process **jobs, int count, bool stopped);
+
+int main(int argc, char **argv){
+    if (argc > 2){
+        printf("Usage: %s [WORKERS]\n", argv[0]);
+        exit(1);
+    }
+    if (argc == 2){
+        bench_workers = atoi(argv[1]);
+        if (bench_workers < 1){
+            printf("invalid argument for number of workers\n");
+            exit(1);
+        }
+    }
+    start_workers(bench_workers);
+    bench_workers = worker_count;
+    srand(1);
+    printf("benchmark,depth,ncpu,workers,ops,ns_per_op\n");
+    for (int d=0; d<BENCH_DEPTHS; d++){
+        bench_pqueue(bench_depths[d]);
+    }
+    for (int c=0; c<BENCH_NCPUS; c++){
+        bench_queue(bench_ncpus[c]);
+    }
+    for (int d=0; d<BENCH_DEPTHS; d++){
+        bench_admission(scan_depths[d]);
+    }
+    bench_mutex();
+    for (int c=0; c<BENCH_NCPUS; c++){
+        bench_tick(bench_ncpus[c]);
+    }
+    return 0;
+}
+
+long now_ns(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+void report(char *name, int depth, int ncpu, long ops, long ns){
+    printf("%s,%d,%d,%d,%ld,%.1f\n", name, depth, ncpu, bench_workers, ops, ops > 0 ? (double) ns / ops : 0.0);
+    fflush(stdout);
+}
+
+struct pqueue *new_pqueue(int capacity){
+    struct pqueue *pq = (struct pqueue *) malloc(sizeof(struct pqueue));
+    if (pq == NULL){
+        perror("malloc");
+        exit(1);
+    }
+    pq->size = 0;
+    pq->capacity = capacity;
+    pq->heap = (struct Process **) malloc(capacity * sizeof(struct Process *));
+    if (pq->heap == NULL){
+        perror("malloc");
+        exit(1);
+    }
+    return pq;
+}
+
+void free_running_queue(){
+    if (running_q == NULL){
+        return;
+    }
+    free(running_q->table);
+    free(running_q);
+    free(batch);
+    free(batch_used);
+    free(batch_used_ms);
+    free(batch_ok);
+    free(held);
+    running_q = NULL;
+}
+
+//insert, pop and re-key of the ready queue at a given depth, with random vruntimes
+void bench_pqueue(int depth){
+    struct Process *jobs = (struct Process *) calloc(depth, sizeof(struct Process));
+    struct pqueue *pq = new_pqueue(depth);
+    if (jobs == NULL){
+        perror("calloc");
+        exit(1);
+    }
+    long inserts = 0, pops = 0, rekeys = 0, insert_ns = 0, pop_ns = 0, rekey_ns = 0;
+    while (inserts < BENCH_OPS){
+        for (int i=0; i<depth; i++){
+            jobs[i].vruntime = rand();
+        }
+        long start = now_ns();
+        for (int i=0; i<depth; i++){
+            penqueue(pq, &jobs[i]);
+        }
+        insert_ns += now_ns() - start;
+        inserts += depth;
+
+        //re-key as renice and critical paths do, a random job moves anywhere in the heap
+        start = now_ns();
+        for (int i=0; i<depth; i++){
+            struct Process *proc = &jobs[(i * 7919) % depth];
+            proc->vruntime = (proc->vruntime * 31 + i) % RAND_MAX;
+            pupdate(pq, proc->heap_index);
+        }
+        rekey_ns += now_ns() - start;
+        rekeys += depth;
+
+        start = now_ns();
+        while (!pqueue_empty(pq)){
+            pdequeue(pq);
+        }
+        pop_ns += now_ns() - start;
+        pops += depth;
+    }
+    report("pqueue_insert", depth, 0, inserts, insert_ns);
+    report("pqueue_rekey", depth, 0, rekeys, rekey_ns);
+    report("pqueue_pop", depth, 0, pops, pop_ns);
+    free(pq->heap);
+    free(pq);
+    free(jobs);
+}
+
+//rotation of the running queue, as the tick and lend_slots go through it
+void bench_queue(int ncpu){
+    struct Process *jobs = (struct Process *) calloc(ncpu, sizeof(struct Process));
+    if (jobs == NULL){
+        perror("calloc");
+        exit(1);
+    }
+    init_running_queue(ncpu);
+    for (int i=0; i<ncpu; i++){
+        enqueue(running_q, &jobs[i]);
+    }
+    long start = now_ns();
+    for (long i=0; i<BENCH_OPS; i++){
+        struct Process *proc = running_q->table[running_q->head];
+        dequeue(running_q);
+        enqueue(running_q, proc);
+    }
+    report("queue_rotate", ncpu, ncpu, BENCH_OPS, now_ns() - start);
+    free_running_queue();
+    free(jobs);
+}
+
+//admission scan over a table of jobs which all wait for a job that has not completed,
+//the worst case as every tick scans the whole window, and the critical path pass over the same table
+void bench_admission(int depth){
+    struct history_struct *table = (struct history_struct *) calloc(1, sizeof(struct history_struct));
+    if (table == NULL){
+        perror("calloc");
+        exit(1);
+    }
+    table->history_count = depth;
+    for (int i=0; i<depth; i++){
+        struct Process *proc = &table->history[SLOT(i)];
+        proc->seq = i;
+        proc->pid = -1;
+        proc->submit = i > 0;
+        proc->after_count = i > 0 ? 1 : 0;
+        proc->after[0] = 0;
+    }
+    struct group *group = &groups[0];
+    group->table = table;
+    group->ready_q = new_pqueue(READY_CAPACITY(4));
+    group->shell_pid = 1;
+    long start = now_ns();
+    for (int r=0; r<BENCH_SCANS; r++){
+        group->admit_from = 0;
+        admit_jobs(group, 0, 4);
+    }
+    report("admission_scan", depth, 4, BENCH_SCANS, now_ns() - start);
+    start = now_ns();
+    for (int r=0; r<BENCH_SCANS; r++){
+        critical_paths(group, 100);
+    }
+    report("critical_paths", depth, 4, BENCH_SCANS, now_ns() - start);
+    free(group->ready_q->heap);
+    free(group->ready_q);
+    memset(group, 0, sizeof(struct group));
+    free(table);
+}
+
+//an uncontended lock and unlock of a robust process-shared mutex, the cost every tick and shell command pays
+void bench_mutex(){
+    pthread_mutex_t mutex;
+    init_mutex(&mutex);
+    long start = now_ns();
+    for (long i=0; i<BENCH_OPS; i++){
+        lock_mutex(&mutex);
+        pthread_mutex_unlock(&mutex);
+    }
+    report("mutex_pair", 0, 0, BENCH_OPS, now_ns() - start);
+    pthread_mutex_destroy(&mutex);
+}
+
+//full ticks over 2*ncpu sleeping children, set up as the scheduler sees a shell: the table is a shared segment
+//attached with attach_group and the jobs come in through admit_jobs, so a queue that admits nothing fails the run
+//every running job is stopped and charged and ncpu jobs are continued, with the groups locked as the scheduler does,
+//so tick is the time a tick holds the table mutexes, the signal rows time the signal calls alone and the latency rows
+//the time until /proc shows every job stopped or running again
+void bench_tick(int ncpu){
+    int count = 2*ncpu;
+    char name[32];
+    snprintf(name, sizeof(name), "%s.%d", REGISTRY_NAME, getpid());
+    int fd = shm_open(name, O_CREAT|O_RDWR, 0600);
+    if (fd == -1 || ftruncate(fd, sizeof(struct history_struct)) == -1){
+        perror("shm_open");
+        exit(1);
+    }
+    struct history_struct *table = mmap(NULL, sizeof(struct history_struct), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if (table == MAP_FAILED){
+        perror("mmap");
+        exit(1);
+    }
+    close(fd);
+    init_mutex(&table->mutex);
+    registry = (struct registry *) calloc(1, sizeof(struct registry));
+    if (registry == NULL){
+        perror("calloc");
+        exit(1);
+    }
+    registry->ncpu = ncpu;
+    init_running_queue(ncpu);
+    for (int i=0; i<count; i++){
+        struct Process *proc = &table->history[i];
+        //the table is shared, so the child must not write its fork result into it
+        int pid = fork();
+        if (pid < 0){
+            perror("fork");
+            exit(1);
+        }
+        if (pid == 0){
+            while (true){
+                pause();
+            }
+        }
+        proc->pid = pid;
+        //stopped like a submitted job until the scheduler dispatches it
+        kill(proc->pid, SIGSTOP);
+        proc->seq = i;
+        proc->submit = true;
+        proc->heap_index = -1;
+        start_time(&proc->start);
+    }
+    table->history_count = count;
+    attach_group(0, getpid());
+    struct group *group = &groups[0];
+    admit_jobs(group, 0, ncpu);
+    int admitted = group->ready_q->size;
+    if (admitted == 0){
+        printf("no job of %d was admitted with %d cpus\n", count, ncpu);
+        exit(1);
+    }
+    dispatch(ncpu, ncpu, 100, false);
+
+    struct Process *stopping[running_q->capacity];
+    long hold = 0, stop = 0, stopped = 0, resume = 0, resumed = 0, check = 0, jobs_stopped = 0, jobs_resumed = 0;
+    for (int r=0; r<BENCH_TICKS; r++){
+        int running = 0;
+        for (int i=running_q->head; i!=running_q->tail; i=(i+1)%running_q->capacity){
+            stopping[running++] = running_q->table[i];
+        }
+        lock_groups();
+        long start = now_ns();
+        preempt_all();
+        long signalled = now_ns();
+        wait_state(stopping, running, true);
+        long resuming = now_ns();
+        dispatch(ncpu, ncpu, 100, false);
+        long continued = now_ns();
+        int dispatched = 0;
+        for (int i=running_q->head; i!=running_q->tail; i=(i+1)%running_q->capacity){
+            batch[dispatched++] = running_q->table[i];
+        }
+        wait_state(batch, dispatched, false);
+        long end = now_ns();
+        unlock_groups();
+        hold += (signalled - start) + (continued - resuming);
+        stop += signalled - start;
+        stopped += resuming - start;
+        resume += continued - resuming;
+        resumed += end - resuming;
+        jobs_stopped += running;
+        jobs_resumed += dispatched;
+
+        //the state check of the 50ms polls
+        int checking = 0;
+        for (int i=running_q->head; i!=running_q->tail; i=(i+1)%running_q->capacity){
+            batch[checking++] = running_q->table[i];
+        }
+        start = now_ns();
+        run_batch(WORK_STATE, checking);
+        check += now_ns() - start;
+    }
+    report("tick_hold", admitted, ncpu, BENCH_TICKS, hold);
+    report("preempt_signal", admitted, ncpu, jobs_stopped, stop);
+    report("preempt_latency", admitted, ncpu, BENCH_TICKS, stopped);
+    report("resume_signal", admitted, ncpu, jobs_resumed, resume);
+    report("resume_latency", admitted, ncpu, BENCH_TICKS, resumed);
+    report("state_check", admitted, ncpu, jobs_resumed, check);
+
+    //release_group continues the jobs it still holds before they are killed
+    int pids[count];
+    for (int i=0; i<count; i++){
+        pids[i] = table->history[i].pid;
+    }
+    release_group(0);
+    for (int i=0; i<count; i++){
+        kill(pids[i], SIGKILL);
+        waitpid(pids[i], NULL, 0);
+    }
+    shm_unlink(name);
+    free(registry);
+    registry = NULL;
+    free_running_queue();
+}
+
+//waits until /proc shows every job stopped, or every job out of the stopped state
+void wait_state(struct Process **jobs, int count, bool stopped){
+    for (int i=0; i<count; i++){
+        while ((job_state(jobs[i]->pid) == 'T') != stopped){
+            sched_yield();
+        }
+    }
+}
@@ -1,41 +1,112 @@
 //header files
+#define _GNU_SOURCE //for sched_getaffinity
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 #include <unistd.h>
+#include <errno.h>
 #include <sys/wait.h>
 #include <sys/time.h>
+#include <sys/resource.h>
 #include <signal.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <fcntl.h>
-#include <semaphore.h>
+#include <pthread.h>
+#include <sched.h>
+#include <ctype.h>
 
 //definitions
 #define MAX_SIZE 50
-#define MAX_HISTORY 75
-#define MAX_SUBMIT 25
+#define MAX_HISTORY 1000
+#define SLOT(seq) ((seq) % MAX_HISTORY) //the table is a ring, the command with sequence number seq is in this slot
+#define PID_BUCKETS 16384 //pid index buckets, a power of two at least twice the pids of MAX_HISTORY pipelines
+#define MAX_SUBMIT 250
+#define READY_CAPACITY(ncpu) (MAX_SUBMIT + 2*(ncpu)) //a ready queue holds MAX_SUBMIT admitted jobs and the 2*ncpu stopped at a tick
+#define MAX_SESSIONS 16
+#define MAX_AFTER 4 //jobs a submitted job can wait for
+#define MAX_STAGES 4 //earlier stages of a pipeline run by the scheduler
+#define MAX_REQUESTS 32
+#define REQUEST_RENICE 0 //change the nice value of a job
+#define REQUEST_RELEASE 1 //take a job out of the scheduler and let it run
+#define REGISTRY_NAME "shm" //host-wide segment through which shells find the scheduler
+#define REGISTRY_MAGIC 0x53524547 //"SREG"
+#define MEMORY_PRESSURE_THRESHOLD 10 //percent of a tick with tasks stalled on memory above which large jobs are held back
+#define CPU_PRESSURE_THRESHOLD 20 //percent of a tick with runnable tasks waiting for a cpu above which a cpu is given up
+#define NICE_LEVELS 40 //nice values -20 to 19
+#define NICE_0_WEIGHT 1024
+#define BLOCKED_POLL_MS 50 //interval in ms at which running jobs are checked for sleeping during a tick
+#define MAX_WORKERS 32 //dispatcher threads
+#define WORK_STOP 0 //stop the jobs of a batch
+#define WORK_RESUME 1 //continue the jobs of a batch
+#define WORK_STATE 2 //read the kernel state of the jobs of a batch
 
 //struct to store process info
 struct Process{
-    int pid, priority;
+    int pid, nice; //nice is -20 to 19 as for the kernel, the job's share of the cpu is given by its weight
     bool submit,queue,completed; // flags
     // submit: process have been submitted
-    // queue: process is in the scheduler's queue
+    // queue: process is in the scheduler's queues, cleared once the scheduler has let go of it after it exited
     // completed: indicates if process have been completed
     char command[MAX_SIZE + 1]; //+1 to accomodate \n or \0
     struct timeval start;
     unsigned long execution_time, wait_time, vruntime;
+    int exit_status; //status from wait4, valid once completed
+    struct rusage usage; //resources used by the process (all stages for a pipeline)
+    long log_index; //record of this process in the history log
+    int group; //session of the process in the scheduler, written by the scheduler
+    long rss_kb; //largest resident set seen while the job ran, its working set, written by the scheduler
+    unsigned long cpu_ticks; //cpu time of the job in clock ticks when it was last resumed, written by the scheduler
+    bool blocked; //job was sleeping or waiting on io at the last check, its cpu is lent out, written by the scheduler
+    int seq; //sequence number of the command in its shell
+    int after[MAX_AFTER], after_count; //sequence numbers of the jobs which have to exit successfully before this one is admitted
+    int dependents; //jobs submitted to wait for this one
+    long hint_ms; //expected cpu time from earlier runs of the same command, 0 if unknown
+    unsigned long path_ms; //expected time left on the longest chain of jobs waiting on this one, written by the scheduler
+    int heap_index; //position in its ready queue while it is queued, written by the scheduler
+    bool released; //taken out of the scheduler by fg or bg, it runs on its own until it exits
+    bool cancelled; //killed before it ever ran because a job it waits for failed, its time is all waiting
+    bool interactive; //foreground command run by the scheduler, the shell is waiting for it
+    int stage_pids[MAX_STAGES], stage_count; //earlier stages of a pipeline, signalled with pid
+    int unreaped; //processes of a pipeline not reaped yet, it completes when the last of them is
+    bool spooled; //stdout and stderr of the job go to its spool file instead of the terminal
+};
+
+//change to a job asked for by the shell, the scheduler owns the queues so it applies them
+struct request{
+    int type; //REQUEST_RENICE or REQUEST_RELEASE
+    int slot, nice;
 };
 
 //history struct used ot store the history of process executions
 struct history_struct {
-    int history_count,ncpu,tslice;
-    sem_t mutex;
+    int history_count,ncpu,tslice; //history_count is the number of commands so far, the last MAX_HISTORY are kept
+    pthread_mutex_t mutex; //robust and shared with the scheduler, a lock whose owner died is taken over
+    int request_count; //requests the scheduler applies at its next check
+    struct request requests[MAX_REQUESTS];
+    int pid_index[PID_BUCKETS]; //open addressing hash from the pids of a command to an entry for its slot and stage, 0 is an empty bucket
     struct Process history[MAX_HISTORY];
 };
 
+//a shell attached to the scheduler, its history_struct is in the segment "shm.<shell_pid>"
+struct session{
+    int shell_pid; //0 if the entry is free
+    bool leaving; //set by the shell when it exits
+};
+
+//host-wide registry of the scheduler and the shells using it
+struct registry{
+    int magic;
+    bool ready; //set once the creating shell has initialised the registry
+    int scheduler_pid, ncpu, tslice;
+    bool auto_slots; //ncpu is an upper bound and the scheduler adapts the cpus it uses to the load
+    int workers; //threads which stop and resume jobs, 0 or 1 does it all in the scheduler thread
+    long launched; //time in seconds at which a shell last started the scheduler, scheduler_pid is -1 until it runs
+    pthread_mutex_t mutex; //robust, a shell or scheduler dying while it holds it does not block the others
+    struct session sessions[MAX_SESSIONS];
+};
+
 // struct for queue data structure
 struct queue{
     int head,tail,capacity,curr;
@@ -48,12 +119,62 @@ struct pqueue{
     struct Process **heap;
 };
 
+//scheduler side state of a session, sessions share the cpus fairly through the group vruntime
+struct group{
+    int shell_pid; //0 if the group is not in use
+    int shm_fd;
+    struct history_struct *table;
+    struct pqueue *ready_q;
+    int admit_from; //every slot before this one is either not a job or already admitted
+    int running; //jobs of the group in the running queue
+    unsigned long vruntime; //cpu time in ms given to the jobs of the group
+};
+
 //function declarations
 void scheduler(int ncpu, int tslice);
+void init_running_queue(int ncpu);
+void admit_jobs(struct group *group, int g, int ncpu);
+unsigned long preempt_all();
+unsigned long preempt_job(struct Process *proc);
+bool stop_job(struct Process *proc, unsigned long *used, unsigned long *used_ms);
+void requeue_job(struct Process *proc, bool stopped, unsigned long used_ms);
+void start_workers(int count);
+void *worker_loop(void *arg);
+void run_batch(int op, int count);
+void work_batch(int worker, int stride);
+void dispatch(int count, int ncpu, int tslice, bool pressure);
+unsigned long lend_slots(int slots, int ncpu, int tslice, bool pressure);
 static void my_handler(int signum);
 void terminate();
 void start_time(struct timeval *start);
 unsigned long end_time(struct timeval *start);
+bool sync_sessions();
+void attach_group(int index, int shell_pid);
+void rebuild_group(struct group *group, int g);
+void release_group(int index);
+void init_mutex(pthread_mutex_t *mutex);
+int lock_mutex(pthread_mutex_t *mutex);
+void lock_groups();
+void unlock_groups();
+void wake_group(struct group *g);
+int dependencies_met(struct group *group, struct Process *proc);
+void critical_paths(struct group *group, int tslice);
+void apply_requests(struct group *group);
+void renice_job(struct group *group, struct Process *proc, int nice);
+void admit_interactive(struct group *group, int g, int ncpu);
+void release_job(struct group *group, struct Process *proc);
+bool signal_job(struct Process *proc, int sig);
+bool continue_job(struct Process *proc);
+int memory_pressure();
+int read_pressure(char *path, unsigned long *last_total, struct timeval *last);
+int adapt_slots(int slots, int ncpu, unsigned long job_ticks, unsigned long elapsed_ms);
+unsigned long job_cpu_ticks(int pid);
+char job_state(int pid);
+long memory_available_kb(long *total_kb);
+long resident_kb(int pid);
+unsigned long pipeline_cpu_ticks(struct Process *proc);
+bool pipeline_runnable(struct Process *proc);
+long pipeline_resident_kb(struct Process *proc);
 bool queue_empty(struct queue *q);
 int next_head(struct queue *q);
 int next_tail(struct queue *q);
@@ -62,18 +183,40 @@ void enqueue(struct queue *q, struct Process *proc);
 void dequeue(struct queue *q);
 bool pqueue_empty(struct pqueue *pq);
 bool pqueue_full(struct pqueue *pq);
-void swap(struct Process* a, struct Process* b);
+bool before(struct Process *a, struct Process *b);
+void swap(struct pqueue *pq, int a, int b);
 void heapifyUp(struct pqueue* pq, int index);
 void heapifyDown(struct pqueue* pq, int index); //min-heapify
 void penqueue(struct pqueue *pq, struct Process *proc); //min-heap-insert
 struct Process* pdequeue(struct pqueue *pq); //min-heap-extract-min
+void pupdate(struct pqueue *pq, int index); //restores the heap after the key at index changed
+void premove(struct pqueue *pq, int index);
 
 //global variables
 int shm_fd;
 bool term = false;
-struct history_struct *process_table;
+struct registry *registry;
+struct group groups[MAX_SESSIONS];
 struct queue *running_q;
-struct pqueue *ready_q;
+struct Process **held; //jobs dispatch passes over, room for every ready queue
+//batch of jobs the workers stop, continue or check
+int worker_count = 1; //the scheduler thread is worker 0
+pthread_barrier_t batch_start, batch_done;
+int batch_op, batch_count;
+struct Process **batch; //sized like the running queue
+unsigned long *batch_used, *batch_used_ms; //clock ticks and ms of cpu time used by stopped jobs
+bool *batch_ok; //job was stopped or continued, false if it has exited
+//weight of every nice value as in the kernel, each level is about 1.25 times the next one
+const int nice_weight[NICE_LEVELS] = {
+    88761, 71755, 56483, 46273, 36291,
+    29154, 23254, 18705, 14949, 11916,
+    9548, 7620, 6100, 4904, 3906,
+    3121, 2501, 1991, 1586, 1277,
+    1024, 820, 655, 526, 423,
+    335, 272, 215, 172, 137,
+    110, 87, 70, 56, 45,
+    36, 29, 23, 18, 15,
+};
 
 int main(){
     //signal part to handle ctrl c (from lecture 7)
@@ -88,175 +231,1008 @@ int main(){
         exit(1);
     }
 
-    //accessing the shm in read-write mode
-    shm_fd = shm_open("shm", O_RDWR, 0666);
+    //accessing the registry in read-write mode, the shell starting the scheduler has created it
+    shm_fd = shm_open(REGISTRY_NAME, O_RDWR, 0666);
     if (shm_fd == -1){
         perror("shm_open");
         exit(1);
     }
-    process_table = mmap(NULL, sizeof(struct history_struct), PROT_READ|PROT_WRITE, MAP_SHARED, shm_fd,0);
-    if (process_table == MAP_FAILED){
+    registry = mmap(NULL, sizeof(struct registry), PROT_READ|PROT_WRITE, MAP_SHARED, shm_fd,0);
+    if (registry == MAP_FAILED){
         perror("mmap");
         exit(1);
     }
-    int ncpu = process_table->ncpu;
-    int tslice = process_table->tslice;
+    int ncpu = registry->ncpu;
+    int tslice = registry->tslice;
 
-    //initialising ready priority queue
-    ready_q = (struct pqueue *) (malloc(sizeof(struct pqueue)));
-    if (ready_q == NULL){
-        perror("malloc");
+    init_running_queue(ncpu);
+
+    //creating daemon process
+    if(daemon(1, 1)){
+        perror("daemon");
         exit(1);
     }
-    ready_q->size = 0;
-    ready_q->capacity = MAX_SUBMIT;
-    ready_q->heap = (struct Process **) malloc(ready_q->capacity * sizeof(struct Process));
-    if (ready_q->heap == NULL){
-        perror("malloc");
+    //daemon forks, so the shell only knows the pid of the process that already exited
+    if (lock_mutex(&registry->mutex) == -1){
+        perror("pthread_mutex_lock");
         exit(1);
     }
-    for (int i=0; i<ready_q->capacity; i++){
-        ready_q->heap[i] = (struct Process *)malloc(sizeof(struct Process));
-        if (ready_q->heap[i] == NULL){
-            perror("malloc");
-            exit(1);
-        }
+    registry->scheduler_pid = getpid();
+    int workers = registry->workers;
+    if ((errno = pthread_mutex_unlock(&registry->mutex)) != 0){
+        perror("pthread_mutex_unlock");
+        exit(1);
     }
-    //initialising running queue
+    //threads are started after daemon, which only keeps the calling thread
+    start_workers(workers < ncpu ? workers : ncpu);
+
+    scheduler(ncpu, tslice);
+    terminate();
+    return 0;
+}
+
+//initialising running queue, shared by every session, and the batch the workers stop and continue
+void init_running_queue(int ncpu){
     running_q = (struct queue *) (malloc(sizeof(struct queue)));
     if (running_q == NULL){
         perror("malloc");
         exit(1);
     }
     running_q->head = running_q->tail = running_q->curr = 0;
-    running_q->capacity = ncpu+1;
-    running_q->table = (struct Process **) malloc(running_q->capacity * sizeof(struct Process));
+    running_q->capacity = 2*ncpu+1; //a cpu lent out by a sleeping job holds the sleeper and its borrower
+    running_q->table = (struct Process **) malloc(running_q->capacity * sizeof(struct Process *));
     if (running_q->table == NULL){
         perror("malloc");
         exit(1);
     }
-    for (int i=0; i<running_q->capacity; i++){
-        running_q->table[i] = (struct Process *)malloc(sizeof(struct Process));
-        if (running_q->table[i] == NULL){
-            perror("malloc");
-            exit(1);
+    batch = (struct Process **) malloc(running_q->capacity * sizeof(struct Process *));
+    batch_used = (unsigned long *) malloc(running_q->capacity * sizeof(unsigned long));
+    batch_used_ms = (unsigned long *) malloc(running_q->capacity * sizeof(unsigned long));
+    batch_ok = (bool *) malloc(running_q->capacity * sizeof(bool));
+    held = (struct Process **) malloc(MAX_SESSIONS * READY_CAPACITY(ncpu) * sizeof(struct Process *));
+    if (batch == NULL || batch_used == NULL || batch_used_ms == NULL || batch_ok == NULL || held == NULL){
+        perror("malloc");
+        exit(1);
+    }
+}
+
+// scheduler function for scheduling and managing processes of every attached shell
+// each tick stops the running jobs and refills the cpus, always from the session with the least group vruntime
+// so sessions get an equal share of the cpus and jobs inside a session share it by their own vruntime
+void scheduler(int ncpu, int tslice){
+    int slots = ncpu; //cpus handed out every tick, adapted between 1 and ncpu in auto mode
+    bool pressure = false;
+    struct timeval tick;
+    start_time(&tick);
+    unsigned long lent_ticks = 0; //clock ticks of borrowers stopped in the middle of the tick
+    while(true){
+        //the tick is slept in short polls, at each one the cpus of running jobs which went to sleep are lent out
+        for (int waited=0; waited<tslice && !term; waited+=BLOCKED_POLL_MS){
+            int nap = tslice - waited < BLOCKED_POLL_MS ? tslice - waited : BLOCKED_POLL_MS;
+            if (usleep(nap * 1000) == -1 && !term){
+                printf("Sleep was interrupted after %d ms\n", waited);
+                exit(1);
+            }
+            if (waited + nap < tslice && !term){
+                lent_ticks += lend_slots(slots, ncpu, tslice, pressure);
+            }
+        }
+        //attaching new shells and letting go of the ones which left, the scheduler exits once nothing is left
+        if (!sync_sessions()){
+            return;
+        }
+        lock_groups();
+        //under memory pressure new jobs (whose size is unknown) are not admitted and large ones are not resumed
+        pressure = memory_pressure() > MEMORY_PRESSURE_THRESHOLD;
+
+        for (int g=0; g<MAX_SESSIONS; g++){
+            struct group *group = &groups[g];
+            if (group->shell_pid == 0){
+                continue;
+            }
+            apply_requests(group);
+            if (!pressure){
+                admit_jobs(group, g, ncpu);
+            }
+            critical_paths(group, tslice);
+        }
+
+        unsigned long job_ticks = preempt_all() + lent_ticks;
+        lent_ticks = 0;
+
+        if (registry->auto_slots){
+            slots = adapt_slots(slots, ncpu, job_ticks, end_time(&tick));
+        }
+        start_time(&tick);
+
+        dispatch(slots, ncpu, tslice, pressure);
+        //something always runs, otherwise nothing would ever free memory
+        if (queue_empty(running_q)){
+            dispatch(-1, ncpu, tslice, pressure);
+        }
+        unlock_groups();
+    }
+}
+
+//adding process to ready queue if they have submit keyword
+//the scan starts at the oldest slot not yet admitted, so a batch of submits is picked up in one pass
+void admit_jobs(struct group *group, int g, int ncpu){
+    //slots of commands more than MAX_HISTORY ago are reused by the shell
+    if (group->admit_from < group->table->history_count - MAX_HISTORY){
+        group->admit_from = group->table->history_count - MAX_HISTORY;
+    }
+    for (int i=group->admit_from; i<group->table->history_count; i++){
+        struct Process *proc = &group->table->history[SLOT(i)];
+        if (proc->submit==true && proc->completed==false && proc->queue==false && !proc->released){
+            //a job waiting for other jobs keeps admit_from at its slot until they have exited
+            int met = dependencies_met(group, proc);
+            if (met == 0){
+                continue;
+            }
+            if (met == -1){
+                //a job it waits for failed, so it is never run, the shell reaps it and its own dependents fail too
+                proc->released=true;
+                proc->cancelled=true;
+                signal_job(proc, SIGKILL);
+            }
+            else if (group->ready_q->size+2*ncpu < group->ready_q->capacity-1){
+                wake_group(group);
+                proc->queue=true;
+                proc->group=g;
+                penqueue(group->ready_q, proc);
+            }
+            else{
+                break;
+            }
         }
+        if (i == group->admit_from){
+            group->admit_from++;
+        }
+    }
+}
+
+//checking running queue and pausing the processes if they haven't terminated
+//the workers stop the jobs, then they go back to their ready queues in the order they ran
+//returns the clock ticks the jobs used
+unsigned long preempt_all(){
+    unsigned long job_ticks = 0;
+    int stopping = 0;
+    while (!queue_empty(running_q)){
+        batch[stopping++] = running_q->table[running_q->head];
+        dequeue(running_q);
+    }
+    run_batch(WORK_STOP, stopping);
+    for (int i=0; i<stopping; i++){
+        requeue_job(batch[i], batch_ok[i], batch_used_ms[i]);
+        job_ticks += batch_used[i];
     }
+    return job_ticks;
+}
 
-    // initialising a semaphore
-    if (sem_init(&process_table->mutex, 1, 1) == -1){
-        perror("sem_init");
+//stops a job taken off the running queue and puts it back into its ready queue
+//the job and its session are charged the cpu time the job used, not the time it spent sleeping on its cpu,
+//returns the clock ticks used
+unsigned long preempt_job(struct Process *proc){
+    unsigned long used, used_ms;
+    bool stopped = stop_job(proc, &used, &used_ms);
+    requeue_job(proc, stopped, used_ms);
+    return used;
+}
+
+//stops a running job and charges the job itself, it only touches the job so workers stop jobs in parallel
+//used is set to the clock ticks and used_ms to the ms of cpu time it used in its slice, false if it has exited
+bool stop_job(struct Process *proc, unsigned long *used, unsigned long *used_ms){
+    unsigned long slice = end_time(&proc->start);
+    unsigned long ticks = pipeline_cpu_ticks(proc);
+    *used = ticks > proc->cpu_ticks ? ticks - proc->cpu_ticks : 0;
+    *used_ms = *used * 1000 / sysconf(_SC_CLK_TCK);
+    if (*used_ms > slice || ticks == 0){
+        *used_ms = slice;
+    }
+    proc->blocked = false;
+    if (proc->completed || !signal_job(proc, SIGSTOP)){
+        return false;
+    }
+    long rss = pipeline_resident_kb(proc);
+    if (rss > proc->rss_kb){
+        proc->rss_kb = rss;
+    }
+    proc->execution_time += slice;
+    //vruntime is in us of cpu time scaled by the job's weight relative to nice 0
+    proc->vruntime += *used_ms * 1000 * NICE_0_WEIGHT / nice_weight[proc->nice + NICE_LEVELS/2];
+    start_time(&proc->start);
+    return true;
+}
+
+//charges the session of a job taken off the running queue and puts the job back into its ready queue,
+//a job which has exited is let go of
+void requeue_job(struct Process *proc, bool stopped, unsigned long used_ms){
+    struct group *group = &groups[proc->group];
+    group->running--;
+    group->vruntime += used_ms;
+    if (stopped){
+        penqueue(group->ready_q, proc);
+    }
+    else{
+        proc->queue = false;
+    }
+}
+
+//hands out count cpus from the ready queues, count -1 resumes a single job ignoring the memory checks
+//every cpu goes to the session with the smallest vruntime counting the slices handed out in this call
+//a job is only resumed if the part of its working set that is not resident fits in the available memory,
+//jobs passed over are held aside and go back to their ready queue at the end
+void dispatch(int count, int ncpu, int tslice, bool pressure){
+    int held_count = 0;
+    bool forced = count == -1;
+    bool exhausted[MAX_SESSIONS] = {false};
+    unsigned long planned[MAX_SESSIONS] = {0};
+    long total_kb;
+    long budget_kb = memory_available_kb(&total_kb);
+    if (forced){
+        count = 1;
+    }
+    int resuming = 0;
+    for (int i=0; i<count; i++){
+        int best = -1;
+        for (int g=0; g<MAX_SESSIONS; g++){
+            if (groups[g].shell_pid != 0 && !exhausted[g] && !pqueue_empty(groups[g].ready_q)
+                && (best == -1 || groups[g].vruntime + planned[g] < groups[best].vruntime + planned[best])){
+                best = g;
+            }
+        }
+        if (best == -1){
+            break;
+        }
+        struct Process *proc = pdequeue(groups[best].ready_q);
+        if (pqueue_empty(groups[best].ready_q)){
+            exhausted[best] = true;
+        }
+        //the working set is only known once the job has run
+        long resident = proc->rss_kb > 0 ? pipeline_resident_kb(proc) : 0;
+        long needed = proc->rss_kb > resident ? proc->rss_kb - resident : 0;
+        bool large = pressure && proc->rss_kb > total_kb / ncpu;
+        if (!forced && (needed > budget_kb || large)){
+            held[held_count++] = proc;
+            i--;
+            continue;
+        }
+        budget_kb -= needed;
+        planned[best] += tslice;
+        batch[resuming++] = proc;
+    }
+    for (int i=0; i<held_count; i++){
+        penqueue(groups[held[i]->group].ready_q, held[i]);
+    }
+    //the workers continue the chosen jobs, the cpus of jobs which exited meanwhile are handed out again
+    run_batch(WORK_RESUME, resuming);
+    int failed = 0;
+    for (int i=0; i<resuming; i++){
+        if (batch_ok[i]){
+            enqueue(running_q, batch[i]);
+            groups[batch[i]->group].running++;
+        }
+        else{
+            batch[i]->queue = false;
+            failed++;
+        }
+    }
+    if (failed > 0){
+        dispatch(forced ? -1 : failed, ncpu, tslice, pressure);
+    }
+}
+
+//checks the state of the running jobs in the middle of a tick
+//the cpu of a job which is sleeping or waiting on io is lent to a ready job, at most one borrower per cpu,
+//and once the sleeper is runnable again the job started last gives the cpu back
+//foreground commands are admitted here too, so they get the next free cpu instead of waiting for the tick
+//returns the clock ticks used by the jobs it stopped, they are our jobs' cpu time in auto mode
+unsigned long lend_slots(int slots, int ncpu, int tslice, bool pressure){
+    unsigned long job_ticks = 0;
+    lock_groups();
+    for (int g=0; g<MAX_SESSIONS; g++){
+        if (groups[g].shell_pid != 0){
+            apply_requests(&groups[g]);
+            if (!pressure){
+                admit_interactive(&groups[g], g, ncpu);
+            }
+        }
+    }
+    int runnable = 0, checking = 0;
+    for (int i=running_q->head; i!=running_q->tail; i=(i+1)%running_q->capacity){
+        batch[checking++] = running_q->table[i];
+    }
+    run_batch(WORK_STATE, checking);
+    for (int i=0; i<checking; i++){
+        if (!batch[i]->blocked){
+            runnable++;
+        }
+    }
+    int lend = slots - runnable;
+    if (lend > running_q->capacity - 1 - running_q->curr){
+        lend = running_q->capacity - 1 - running_q->curr;
+    }
+    if (lend > 0){
+        dispatch(lend, ncpu, tslice, pressure);
+    }
+    for (; runnable>slots; runnable--){
+        int last = -1;
+        for (int i=0; i<running_q->curr; i++){
+            if (!running_q->table[(running_q->head + i) % running_q->capacity]->blocked){
+                last = i;
+            }
+        }
+        for (int i=0, n=running_q->curr; i<n; i++){
+            struct Process *proc = running_q->table[running_q->head];
+            dequeue(running_q);
+            if (i == last){
+                job_ticks += preempt_job(proc);
+            }
+            else{
+                enqueue(running_q, proc);
+            }
+        }
+    }
+    unlock_groups();
+    return job_ticks;
+}
+
+//brings the groups in line with the sessions in the registry
+//returns false when the scheduler should exit, which it does once no shell is attached and no job is left
+bool sync_sessions(){
+    if (lock_mutex(&registry->mutex) == -1){
+        perror("pthread_mutex_lock");
         exit(1);
     }
-    //creating daemon process
-    if(daemon(1, 1)){
-        perror("daemon");
+    bool busy = !queue_empty(running_q);
+    for (int i=0; i<MAX_SESSIONS; i++){
+        struct session *session = &registry->sessions[i];
+        if (groups[i].shell_pid != 0 && groups[i].shell_pid != session->shell_pid){
+            release_group(i);
+        }
+        if (session->shell_pid == 0){
+            continue;
+        }
+        //a shell which left or died without leaving gives its slot back
+        if (session->leaving || (kill(session->shell_pid, 0) == -1 && errno == ESRCH)){
+            if (groups[i].shell_pid != 0){
+                release_group(i);
+            }
+            session->shell_pid = 0;
+            session->leaving = false;
+            continue;
+        }
+        if (groups[i].shell_pid == 0){
+            attach_group(i, session->shell_pid);
+        }
+        busy = true;
+    }
+    if (!busy || term){
+        //shells attaching from now on start a new scheduler
+        registry->scheduler_pid = 0;
+        busy = false;
+    }
+    if ((errno = pthread_mutex_unlock(&registry->mutex)) != 0){
+        perror("pthread_mutex_unlock");
         exit(1);
     }
+    return busy;
+}
 
-    scheduler(ncpu, tslice);
+//maps the segment of a new session and gives it a ready queue
+void attach_group(int index, int shell_pid){
+    struct group *group = &groups[index];
+    char name[32];
+    snprintf(name, sizeof(name), "%s.%d", REGISTRY_NAME, shell_pid);
+    group->shm_fd = shm_open(name, O_RDWR, 0666);
+    if (group->shm_fd == -1){
+        //the shell registers before its segment is ready, it is picked up on a later tick
+        return;
+    }
+    group->table = mmap(NULL, sizeof(struct history_struct), PROT_READ|PROT_WRITE, MAP_SHARED, group->shm_fd,0);
+    if (group->table == MAP_FAILED){
+        perror("mmap");
+        exit(1);
+    }
+    group->ready_q = (struct pqueue *) (malloc(sizeof(struct pqueue)));
+    if (group->ready_q == NULL){
+        perror("malloc");
+        exit(1);
+    }
+    group->ready_q->size = 0;
+    //sized from NCPU, with a fixed size the 2*ncpu kept free for stopped jobs would leave no room on a large host
+    group->ready_q->capacity = READY_CAPACITY(registry->ncpu);
+    group->ready_q->heap = (struct Process **) malloc(group->ready_q->capacity * sizeof(struct Process *));
+    if (group->ready_q->heap == NULL){
+        perror("malloc");
+        exit(1);
+    }
+    group->admit_from = 0;
+    group->running = 0;
+    group->vruntime = 0;
+    group->shell_pid = shell_pid;
+    rebuild_group(group, index);
+}
 
-    //cleanup for mallocs
-    for (int i=running_q->capacity-1; i<0; i--) {
-        free(running_q->table[i]);
+//a scheduler started after the last one died takes over the jobs that one had queued, in one pass over the table
+//they are all stopped and go back to the ready queue, which is heapified once, nothing was left in the running queue
+//so no job runs twice, and a job which does not fit any more is admitted again by a later scan
+void rebuild_group(struct group *group, int g){
+    struct history_struct *table = group->table;
+    struct pqueue *pq = group->ready_q;
+    int ncpu = registry->ncpu;
+    if (lock_mutex(&table->mutex) == -1){
+        perror("pthread_mutex_lock");
+        exit(1);
     }
-    free(running_q->table);
-    free(running_q);
-    for (int i=ready_q->capacity-1; i<0; i--){
-        free(ready_q->heap[i]);
-    }
-    free(ready_q->heap);
-    free(ready_q);
-    // destroying the semaphore
-    if (sem_destroy(&process_table->mutex) == -1){
-        perror("shm_destroy");
+    int first = table->history_count > MAX_HISTORY ? table->history_count - MAX_HISTORY : 0;
+    for (int i=first; i<table->history_count; i++){
+        struct Process *proc = &table->history[SLOT(i)];
+        if (!proc->queue){
+            continue;
+        }
+        if (proc->completed || proc->released){
+            proc->queue = false;
+            continue;
+        }
+        //a job the old scheduler left running is stopped and charged as at the end of its slice,
+        //the cpu_ticks it was resumed with are still in the table, so its run time is not counted as waiting
+        bool stopped;
+        if (job_state(proc->pid) == 'T'){
+            stopped = signal_job(proc, SIGSTOP);
+        }
+        else{
+            unsigned long used, used_ms;
+            stopped = stop_job(proc, &used, &used_ms);
+            group->vruntime += used_ms;
+        }
+        if (stopped && pq->size+2*ncpu < pq->capacity-1){
+            proc->group = g;
+            proc->heap_index = pq->size;
+            pq->heap[pq->size++] = proc;
+        }
+        else{
+            proc->queue = false;
+        }
+    }
+    for (int i=pq->size/2-1; i>=0; i--){
+        heapifyDown(pq, i);
+    }
+    if ((errno = pthread_mutex_unlock(&table->mutex)) != 0){
+        perror("pthread_mutex_unlock");
         exit(1);
     }
-    // unmapping shared memory segment followed by a "close" call
-    if (munmap(process_table, sizeof(struct history_struct)) < 0){
-        printf("Error unmapping\n");
+}
+
+//detaches a session, its jobs are resumed so that nothing stays stopped once no shell is left to record them
+void release_group(int index){
+    struct group *group = &groups[index];
+    lock_groups();
+    for (int i=0, n=running_q->curr; i<n; i++){
+        struct Process *proc = running_q->table[running_q->head];
+        dequeue(running_q);
+        if (proc->group != index){
+            enqueue(running_q, proc);
+        }
+    }
+    while (!pqueue_empty(group->ready_q)){
+        struct Process *proc = pdequeue(group->ready_q);
+        if (!proc->completed){
+            kill(proc->pid, SIGCONT);
+        }
+    }
+    for (int i=group->admit_from; i<group->table->history_count; i++){
+        struct Process *proc = &group->table->history[SLOT(i)];
+        if (proc->submit && !proc->completed && !proc->queue){
+            kill(proc->pid, SIGCONT);
+        }
+    }
+    unlock_groups();
+    free(group->ready_q->heap);
+    free(group->ready_q);
+    if (munmap(group->table, sizeof(struct history_struct)) < 0){
         perror("munmap");
         exit(1);
     }
-    if (close(shm_fd) == -1){
+    if (close(group->shm_fd) == -1){
         perror("close");
         exit(1);
     }
+    group->shell_pid = 0;
+}
+
+//initialises a mutex in shared memory, robust so that a process dying while it holds it does not block the others
+void init_mutex(pthread_mutex_t *mutex){
+    pthread_mutexattr_t attr;
+    int err = pthread_mutexattr_init(&attr);
+    if (err == 0){
+        err = pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    }
+    if (err == 0){
+        err = pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    }
+    if (err == 0){
+        err = pthread_mutex_init(mutex, &attr);
+    }
+    if (err != 0){
+        errno = err;
+        perror("pthread_mutex_init");
+        exit(1);
+    }
+    pthread_mutexattr_destroy(&attr);
+}
+
+//locks a shared mutex, returns -1 with errno set on failure
+//a shell that died holding its table, or a scheduler before this one, does not block the daemon:
+//the lock is taken over and the table used as it is, at worst one entry is half way through an update
+int lock_mutex(pthread_mutex_t *mutex){
+    int err = pthread_mutex_lock(mutex);
+    if (err == EOWNERDEAD){
+        err = pthread_mutex_consistent(mutex);
+    }
+    if (err != 0){
+        errno = err;
+        return -1;
+    }
     return 0;
 }
 
-// scheduler function for scheduling and managing processes
-void scheduler(int ncpu, int tslice){
-    while(true){
-        unsigned int remaining_sleep = sleep(tslice / 1000);
-        if (remaining_sleep > 0){
-            printf("Sleep was interrupted after %u seconds\n", remaining_sleep);
+//locks the tables of every session, always in the same order so shells and the scheduler cannot deadlock
+void lock_groups(){
+    for (int g=0; g<MAX_SESSIONS; g++){
+        if (groups[g].shell_pid != 0 && lock_mutex(&groups[g].table->mutex) == -1){
+            perror("pthread_mutex_lock");
             exit(1);
         }
-        if (sem_wait(&process_table->mutex) == -1){
-            perror("sem_wait");
+    }
+}
+
+void unlock_groups(){
+    for (int g=MAX_SESSIONS-1; g>=0; g--){
+        if (groups[g].shell_pid != 0 && (errno = pthread_mutex_unlock(&groups[g].table->mutex)) != 0){
+            perror("pthread_mutex_unlock");
             exit(1);
         }
-        //this if-block ensures that scheduler terminates after natural termination of all processes
-        if (term && queue_empty(running_q) && pqueue_empty(ready_q)){
-            terminate();
+    }
+}
+
+//a session with nothing queued or running does not bank cpu time while idle,
+//it restarts at the smallest group vruntime among the busy sessions
+void wake_group(struct group *g){
+    if (g->running > 0 || !pqueue_empty(g->ready_q)){
+        return;
+    }
+    bool found = false;
+    unsigned long min_vruntime = 0;
+    for (int i=0; i<MAX_SESSIONS; i++){
+        struct group *other = &groups[i];
+        if (other != g && other->shell_pid != 0 && (other->running > 0 || !pqueue_empty(other->ready_q))
+            && (!found || other->vruntime < min_vruntime)){
+            min_vruntime = other->vruntime;
+            found = true;
         }
+    }
+    if (found && g->vruntime < min_vruntime){
+        g->vruntime = min_vruntime;
+    }
+}
 
-        //adding process to ready queue if they have submit keyword
-        for (int i=0; i<process_table->history_count; i++){
-            if (process_table->history[i].submit==true && process_table->history[i].completed==false && process_table->history[i].queue==false){
-                if (ready_q->size+ncpu < ready_q->capacity-1){
-                    process_table->history[i].queue=true;
-                    penqueue(ready_q, &process_table->history[i]);
-                }
-                else{
-                    break;
-                }
-            }
+//continues a job taken from its ready queue and starts its slice, it only touches the job so workers continue jobs in parallel
+bool continue_job(struct Process *proc){
+    proc->wait_time += end_time(&proc->start);
+    start_time(&proc->start);
+    proc->cpu_ticks = pipeline_cpu_ticks(proc);
+    return signal_job(proc, SIGCONT);
+}
+
+//starts the dispatcher threads, the scheduler thread works on every batch as worker 0
+void start_workers(int count){
+    if (count > MAX_WORKERS){
+        count = MAX_WORKERS;
+    }
+    if (count <= 1){
+        return;
+    }
+    if (pthread_barrier_init(&batch_start, NULL, count) != 0 || pthread_barrier_init(&batch_done, NULL, count) != 0){
+        perror("pthread_barrier_init");
+        exit(1);
+    }
+    for (long w=1; w<count; w++){
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, worker_loop, (void *) w) != 0){
+            perror("pthread_create");
+            exit(1);
         }
+        pthread_detach(thread);
+    }
+    worker_count = count;
+}
 
-        //checking running queue and pausing the processes if they haven't terminated
-        if (!queue_empty(running_q)){
-            for (int i=0; i<ncpu; i++){
-                if (!queue_empty(running_q)){
-                    if (!running_q->table[running_q->head]->completed){
-                        penqueue(ready_q, running_q->table[running_q->head]);
-                        running_q->table[running_q->head]->execution_time += end_time(&running_q->table[running_q->head]->start);
-                        running_q->table[running_q->head]->vruntime += running_q->table[running_q->head]->execution_time *running_q->table[running_q->head]->priority;
-                        start_time(&running_q->table[running_q->head]->start);
-                        if (kill(running_q->table[running_q->head]->pid, SIGSTOP) == -1){
-                            perror("kill");
-                            exit(1);
-                        }
-                        dequeue(running_q);
-                    }
-                    else{
-                        dequeue(running_q);
-                    }
-                }
-            }
+//a dispatcher thread waits for a batch, does its share of it and waits for the others to finish
+void *worker_loop(void *arg){
+    int worker = (int)(long) arg;
+    //SIGINT is left to the scheduler thread
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    while (true){
+        pthread_barrier_wait(&batch_start);
+        work_batch(worker, worker_count);
+        pthread_barrier_wait(&batch_done);
+    }
+    return NULL;
+}
+
+//stops, continues or checks the first count jobs of the batch, in parallel when there are workers
+//the scheduler thread holds the groups locked, so only the jobs themselves are touched meanwhile
+void run_batch(int op, int count){
+    batch_op = op;
+    batch_count = count;
+    if (worker_count == 1 || count <= 1){
+        work_batch(0, 1);
+        return;
+    }
+    pthread_barrier_wait(&batch_start);
+    work_batch(0, worker_count);
+    pthread_barrier_wait(&batch_done);
+}
+
+//the share of the batch of one worker, every stride-th job starting at worker
+void work_batch(int worker, int stride){
+    for (int i=worker; i<batch_count; i+=stride){
+        struct Process *proc = batch[i];
+        if (batch_op == WORK_STOP){
+            batch_ok[i] = stop_job(proc, &batch_used[i], &batch_used_ms[i]);
+        }
+        else if (batch_op == WORK_RESUME){
+            batch_ok[i] = continue_job(proc);
+        }
+        else{
+            proc->blocked = proc->completed || !pipeline_runnable(proc);
+        }
+    }
+}
+
+//sends a signal to a job, a job which no longer exists is treated as completed
+//the earlier stages of a pipeline get it first, they may have exited before the last one
+bool signal_job(struct Process *proc, int sig){
+    for (int s=0; s<proc->stage_count; s++){
+        kill(proc->stage_pids[s], sig);
+    }
+    if (kill(proc->pid, sig) == -1){
+        if (errno != ESRCH){
+            perror("kill");
+            exit(1);
+        }
+        //the shell has reaped it and marks it completed once it has recorded its exit status
+        return false;
+    }
+    return true;
+}
+
+//1 when every job this one waits for has exited with status 0, 0 while one has not completed and -1 if one failed
+//a job whose slot was reused has completed, the shell kills the jobs waiting for it before reusing it if it failed
+int dependencies_met(struct group *group, struct Process *proc){
+    int met = 1;
+    for (int k=0; k<proc->after_count; k++){
+        struct Process *parent = &group->table->history[SLOT(proc->after[k])];
+        if (parent->seq != proc->after[k]){
+            continue;
+        }
+        if (!parent->completed){
+            met = 0;
+        }
+        else if (!WIFEXITED(parent->exit_status) || WEXITSTATUS(parent->exit_status) != 0){
+            return -1;
+        }
+    }
+    return met;
+}
+
+//applies the renice and release requests the shell queued since the last check
+void apply_requests(struct group *group){
+    struct history_struct *table = group->table;
+    for (int r=0; r<table->request_count; r++){
+        struct Process *proc = &table->history[table->requests[r].slot];
+        if (table->requests[r].type == REQUEST_RENICE){
+            renice_job(group, proc, table->requests[r].nice);
         }
+        else{
+            release_job(group, proc);
+        }
+    }
+    table->request_count = 0;
+}
+
+//changes the weight of a job, a queued job keeps its place relative to the others in time rather than vruntime:
+//its lag behind the smallest vruntime of the queue is scaled by old weight/new weight and it is moved in the heap
+void renice_job(struct group *group, struct Process *proc, int nice){
+    int old_weight = nice_weight[proc->nice + NICE_LEVELS/2];
+    proc->nice = nice;
+    if (proc->queue && proc->heap_index >= 0){
+        unsigned long min_vruntime = group->ready_q->heap[0]->vruntime;
+        proc->vruntime = min_vruntime + (proc->vruntime - min_vruntime) * old_weight / nice_weight[nice + NICE_LEVELS/2];
+        pupdate(group->ready_q, proc->heap_index);
+    }
+}
+
+//queues the foreground commands of a group between ticks, every other job is admitted at the tick
+void admit_interactive(struct group *group, int g, int ncpu){
+    for (int i=group->admit_from; i<group->table->history_count; i++){
+        struct Process *proc = &group->table->history[SLOT(i)];
+        if (proc->interactive && proc->submit && !proc->completed && !proc->queue && !proc->released
+            && group->ready_q->size+2*ncpu < group->ready_q->capacity-1){
+            wake_group(group);
+            proc->queue = true;
+            proc->group = g;
+            penqueue(group->ready_q, proc);
+        }
+    }
+}
+
+//takes a job out of the ready queue or the running queue for fg and bg, it is never admitted or stopped again
+void release_job(struct group *group, struct Process *proc){
+    bool running = false;
+    if (proc->queue && proc->heap_index >= 0){
+        premove(group->ready_q, proc->heap_index);
+    }
+    for (int i=0, n=running_q->curr; i<n; i++){
+        struct Process *other = running_q->table[running_q->head];
+        dequeue(running_q);
+        if (other == proc){
+            running = true;
+            group->running--;
+        }
+        else{
+            enqueue(running_q, other);
+        }
+    }
+    proc->queue = false;
+    if (running){
+        proc->execution_time += end_time(&proc->start);
+    }
+    else{
+        proc->wait_time += end_time(&proc->start);
+    }
+    start_time(&proc->start);
+    signal_job(proc, SIGCONT);
+}
 
-        //adding processes to running queue and resume their execution
-        if (!pqueue_empty(ready_q)){
-            for (int i=0; i<ncpu; i++){
-                if (!pqueue_empty(ready_q)){
-                    struct Process *proc = pdequeue(ready_q);
-                    proc->wait_time += end_time(&proc->start);
-                    start_time(&proc->start);
-                    if (kill(proc->pid, SIGCONT) == -1){
-                        perror("kill");
-                        exit(1);
-                    }
-                    enqueue(running_q, proc);
+//expected time left on the longest chain of dependent jobs starting at every pending job of a group,
+//from the runtime hint of each job (a time quantum if unknown), ready jobs on longer chains are run first
+//jobs only wait for earlier commands, so one pass from the newest command sees every dependent first
+void critical_paths(struct group *group, int tslice){
+    static unsigned long below[MAX_HISTORY]; //longest chain of dependents of a slot
+    bool changed = false;
+    int first = group->table->history_count > MAX_HISTORY ? group->table->history_count - MAX_HISTORY : 0;
+    memset(below, 0, sizeof(below));
+    for (int seq=group->table->history_count-1; seq>=first; seq--){
+        int i = SLOT(seq);
+        struct Process *proc = &group->table->history[i];
+        unsigned long path = 0;
+        if (proc->submit && !proc->completed){
+            unsigned long left = tslice;
+            if (proc->hint_ms > 0){
+                left = (unsigned long) proc->hint_ms > proc->execution_time ? proc->hint_ms - proc->execution_time : 0;
+            }
+            path = left + below[i];
+            for (int k=0; k<proc->after_count; k++){
+                if (proc->after[k] >= first && below[SLOT(proc->after[k])] < path){
+                    below[SLOT(proc->after[k])] = path;
                 }
             }
         }
-        if (sem_post(&process_table->mutex) == -1){
-            perror("sem_post");
-            exit(1);
+        if (proc->path_ms != path){
+            proc->path_ms = path;
+            changed = proc->queue || changed;
         }
     }
+    //paths only break ties in the ready queue, it is rebuilt when one of them moved
+    if (changed){
+        for (int i=group->ready_q->size/2-1; i>=0; i--){
+            heapifyDown(group->ready_q, i);
+        }
+    }
+}
+
+//memory pressure from PSI, the share of the time since the last call during which some task stalled on memory
+//returns 0 when the kernel does not provide /proc/pressure/memory
+int memory_pressure(){
+    static unsigned long last_total = 0;
+    static struct timeval last;
+    return read_pressure("/proc/pressure/memory", &last_total, &last);
+}
+
+//share of the time since the last reading during which some task stalled on the resource of a PSI file
+int read_pressure(char *path, unsigned long *last_total, struct timeval *last){
+    unsigned long total;
+    FILE *psi = fopen(path, "r");
+    if (psi == NULL){
+        return 0;
+    }
+    int found = fscanf(psi, "some avg10=%*f avg60=%*f avg300=%*f total=%lu", &total);
+    fclose(psi);
+    if (found != 1){
+        return 0;
+    }
+    int percent = 0;
+    if (*last_total != 0){
+        unsigned long elapsed_us = end_time(last) * 1000;
+        percent = elapsed_us > 0 ? (total - *last_total) * 100 / elapsed_us : 0;
+    }
+    *last_total = total;
+    start_time(last);
+    return percent;
+}
+
+//cpus to hand out next tick in auto mode, moving by at most one per tick
+//the cpus busy with work other than our jobs (other tenants, the shell's own commands) are taken from the lines
+//of /proc/stat for the cpus in our affinity mask and left free, and a cpu is given up while PSI shows runnable
+//tasks waiting for a cpu
+int adapt_slots(int slots, int ncpu, unsigned long job_ticks, unsigned long elapsed_ms){
+    static unsigned long last_busy = 0, last_total = 0;
+    static unsigned long last_psi = 0;
+    static struct timeval last_psi_time;
+    unsigned long user, nice, system, idle, iowait, irq, softirq, steal;
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1){
+        return slots;
+    }
+    FILE *stat = fopen("/proc/stat", "r");
+    if (stat == NULL){
+        return slots;
+    }
+    //load on cpus we may not run on says nothing about the cpus we have
+    char line[256];
+    int cpu, cpus = 0;
+    unsigned long busy = 0, total = 0;
+    while (fgets(line, sizeof(line), stat) != NULL && strncmp(line, "cpu", 3) == 0){
+        //the first line sums every cpu, the per cpu lines follow it
+        if (!isdigit((unsigned char) line[3]) || sscanf(line, "cpu%d %lu %lu %lu %lu %lu %lu %lu %lu", &cpu, &user, &nice, &system, &idle, &iowait, &irq, &softirq, &steal) != 9
+            || cpu < 0 || cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, &allowed)){
+            continue;
+        }
+        busy += user + nice + system + irq + softirq + steal;
+        total += user + nice + system + irq + softirq + steal + idle + iowait;
+        cpus++;
+    }
+    fclose(stat);
+    int pressure = read_pressure("/proc/pressure/cpu", &last_psi, &last_psi_time);
+    if (cpus == 0 || elapsed_ms == 0){
+        return slots;
+    }
+    int target = slots;
+    if (last_total != 0 && total > last_total){
+        //busy time is in ticks of each of our cpus, so the share of it scaled by their count gives busy cpus
+        double busy_cpus = (double)(busy - last_busy) / (total - last_total) * cpus;
+        double job_cpus = (double) job_ticks / sysconf(_SC_CLK_TCK) / (elapsed_ms / 1000.0);
+        double other_cpus = busy_cpus > job_cpus ? busy_cpus - job_cpus : 0;
+        target = ncpu - (int)(other_cpus + 0.5);
+    }
+    last_busy = busy;
+    last_total = total;
+    if (pressure > CPU_PRESSURE_THRESHOLD && target >= slots){
+        target = slots - 1;
+    }
+    if (target > slots){
+        slots++;
+    }
+    else if (target < slots){
+        slots--;
+    }
+    if (slots < 1){
+        slots = 1;
+    }
+    if (slots > ncpu){
+        slots = ncpu;
+    }
+    return slots;
+}
+
+//user and system time of a process in clock ticks from /proc/<pid>/stat, 0 if it cannot be read
+unsigned long job_cpu_ticks(int pid){
+    char path[32], buffer[1024];
+    unsigned long utime = 0, stime = 0;
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    FILE *stat = fopen(path, "r");
+    if (stat == NULL){
+        return 0;
+    }
+    size_t length = fread(buffer, 1, sizeof(buffer)-1, stat);
+    fclose(stat);
+    buffer[length] = '\0';
+    //the command name may contain spaces, the fields after it start behind the last ')'
+    char *fields = strrchr(buffer, ')');
+    if (fields == NULL || sscanf(fields + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2){
+        return 0;
+    }
+    return utime + stime;
+}
+
+//kernel state of a process from /proc/<pid>/stat, R when it is runnable, 0 if it cannot be read
+char job_state(int pid){
+    char path[32], buffer[1024];
+    char state = 0;
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    FILE *stat = fopen(path, "r");
+    if (stat == NULL){
+        return 0;
+    }
+    size_t length = fread(buffer, 1, sizeof(buffer)-1, stat);
+    fclose(stat);
+    buffer[length] = '\0';
+    char *fields = strrchr(buffer, ')');
+    if (fields == NULL || sscanf(fields + 2, "%c", &state) != 1){
+        return 0;
+    }
+    return state;
+}
+
+//cpu ticks of a job, a pipeline is charged for every stage
+unsigned long pipeline_cpu_ticks(struct Process *proc){
+    unsigned long ticks = job_cpu_ticks(proc->pid);
+    for (int s=0; s<proc->stage_count; s++){
+        ticks += job_cpu_ticks(proc->stage_pids[s]);
+    }
+    return ticks;
+}
+
+//a pipeline is blocked only when none of its stages is runnable
+bool pipeline_runnable(struct Process *proc){
+    if (job_state(proc->pid) == 'R'){
+        return true;
+    }
+    for (int s=0; s<proc->stage_count; s++){
+        if (job_state(proc->stage_pids[s]) == 'R'){
+            return true;
+        }
+    }
+    return false;
+}
+
+//resident set of a job in kB, summed over the stages of a pipeline
+long pipeline_resident_kb(struct Process *proc){
+    long kb = resident_kb(proc->pid);
+    for (int s=0; s<proc->stage_count; s++){
+        kb += resident_kb(proc->stage_pids[s]);
+    }
+    return kb;
+}
+
+//available and total memory from /proc/meminfo in kB
+long memory_available_kb(long *total_kb){
+    char line[128];
+    long available = 0;
+    *total_kb = 0;
+    FILE *meminfo = fopen("/proc/meminfo", "r");
+    if (meminfo == NULL){
+        return 0;
+    }
+    while (fgets(line, sizeof(line), meminfo) != NULL){
+        sscanf(line, "MemTotal: %ld kB", total_kb);
+        if (sscanf(line, "MemAvailable: %ld kB", &available) == 1){
+            break;
+        }
+    }
+    fclose(meminfo);
+    return available;
+}
+
+//resident set of a process in kB, 0 if it cannot be read
+long resident_kb(int pid){
+    char path[32];
+    long pages = 0;
+    snprintf(path, sizeof(path), "/proc/%d/statm", pid);
+    FILE *statm = fopen(path, "r");
+    if (statm == NULL){
+        return 0;
+    }
+    if (fscanf(statm, "%*s %ld", &pages) != 1){
+        pages = 0;
+    }
+    fclose(statm);
+    return pages * (sysconf(_SC_PAGESIZE) / 1024);
 }
 
 //signal handler
@@ -269,26 +1245,18 @@ static void my_handler(int signum){
 
 //function to terminate scheduler
 void terminate(){
-    printf("\nCaught SIGINT signal for termination\n");
     printf("Terminating simple scheduler...\n");
-    //cleanups for malloc
-    for (int i=running_q->capacity-1; i<0; i--) {
-        free(running_q->table[i]);
+    //letting go of every session still attached, their jobs are resumed
+    for (int i=0; i<MAX_SESSIONS; i++){
+        if (groups[i].shell_pid != 0){
+            release_group(i);
+        }
     }
+    //cleanups for malloc
     free(running_q->table);
     free(running_q);
-    for (int i=ready_q->capacity-1; i<0; i--){
-        free(ready_q->heap[i]);
-    }
-    free(ready_q->heap);
-    free(ready_q);
-    // destroying the semaphore
-    if (sem_destroy(&process_table->mutex) == -1){
-        perror("shm_destroy");
-        exit(1);
-    }
     // unmapping shared memory segment followed by a "close" call
-    if (munmap(process_table, sizeof(struct history_struct)) < 0){
+    if (munmap(registry, sizeof(struct registry)) < 0){
         printf("Error unmapping\n");
         perror("munmap");
         exit(1);
@@ -366,17 +1334,28 @@ bool pqueue_full(struct pqueue *pq){
     return pq->size == pq->capacity;
 }
 
-void swap(struct Process* a, struct Process* b){
-    struct Process temp = *a;
-    *a = *b;
-    *b = temp;
+//ready queue order, foreground commands first, then least vruntime and the longer critical path on a tie
+bool before(struct Process *a, struct Process *b){
+    if (a->interactive != b->interactive){
+        return a->interactive;
+    }
+    return a->vruntime < b->vruntime || (a->vruntime == b->vruntime && a->path_ms > b->path_ms);
+}
+
+//swaps two entries of the heap, the processes stay in their slots of the shared table and know their position
+void swap(struct pqueue *pq, int a, int b){
+    struct Process *temp = pq->heap[a];
+    pq->heap[a] = pq->heap[b];
+    pq->heap[b] = temp;
+    pq->heap[a]->heap_index = a;
+    pq->heap[b]->heap_index = b;
 }
 
 void heapifyUp(struct pqueue* pq, int index){
     while (index>0){
         int parent = (index-1)/2;
-        if (pq->heap[index]->vruntime < pq->heap[parent]->vruntime){
-            swap(pq->heap[index], pq->heap[parent]);
+        if (before(pq->heap[index], pq->heap[parent])){
+            swap(pq, index, parent);
             index = parent;
         }
         else{
@@ -390,16 +1369,16 @@ void heapifyDown(struct pqueue* pq, int index){
     int rightChild = 2*index + 2;
     int smallest = index;
 
-    if (leftChild<pq->size && pq->heap[leftChild]->vruntime < pq->heap[smallest]->vruntime){
+    if (leftChild<pq->size && before(pq->heap[leftChild], pq->heap[smallest])){
         smallest = leftChild;
     }
 
-    if (rightChild<pq->size && pq->heap[rightChild]->vruntime < pq->heap[smallest]->vruntime){
+    if (rightChild<pq->size && before(pq->heap[rightChild], pq->heap[smallest])){
         smallest = rightChild;
     }
 
     if (smallest != index){
-        swap(pq->heap[index], pq->heap[smallest]);
+        swap(pq, index, smallest);
         heapifyDown(pq, smallest);
     }
 }
@@ -407,6 +1386,7 @@ void heapifyDown(struct pqueue* pq, int index){
 void penqueue(struct pqueue *pq, struct Process *proc){
     if (pq->size < pq->capacity){
         pq->heap[pq->size] = proc;
+        proc->heap_index = pq->size;
         heapifyUp(pq, pq->size);
         pq->size++;
     }
@@ -415,10 +1395,25 @@ void penqueue(struct pqueue *pq, struct Process *proc){
 struct Process* pdequeue(struct pqueue *pq){
     if (pq->size>0){
         struct Process* removed = pq->heap[0];
-        pq->heap[0] = pq->heap[pq->size - 1];
-        pq->size--;
-        heapifyDown(pq, 0);
+        premove(pq, 0);
         return removed;
     }
     return NULL;
+}
+
+void pupdate(struct pqueue *pq, int index){
+    struct Process *proc = pq->heap[index];
+    heapifyUp(pq, index);
+    heapifyDown(pq, proc->heap_index);
+}
+
+//the last entry takes the place of the removed one and moves up or down from there
+void premove(struct pqueue *pq, int index){
+    pq->heap[index]->heap_index = -1;
+    pq->size--;
+    if (index < pq->size){
+        pq->heap[index] = pq->heap[pq->size];
+        pq->heap[index]->heap_index = index;
+        pupdate(pq, index);
+    }
 }
\ No newline at end of file
@@ -1,4 +1,5 @@
 //header files
+#define _GNU_SOURCE //for splice, tee and F_SETPIPE_SZ
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,40 +7,172 @@
 #include <unistd.h>
 #include <sys/wait.h>
 #include <sys/time.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <poll.h>
 #include <signal.h>
 #include <sys/mman.h>
+#include <sys/file.h>
+#include <sched.h>
 #include <sys/stat.h>
 #include <fcntl.h>
-#include <semaphore.h>
+#include <pthread.h>
+#include <errno.h>
+#include <dirent.h>
+#include <limits.h>
 
 //definitions
 #define MAX_SIZE 50
-#define MAX_HISTORY 75
+#define MAX_HISTORY 1000
+#define SLOT(seq) ((seq) % MAX_HISTORY) //the table is a ring, the command with sequence number seq is in this slot
+#define PID_BUCKETS 16384 //pid index buckets, a power of two at least twice the pids of MAX_HISTORY pipelines
 #define MAX_WORDS 10
 #define MAX_COMMANDS 5
+#define MAX_BATCH 500
+#define SPLICE_CHUNK (1<<20)
+#define MAX_PARALLEL_WINDOW 256
+#define MAX_PRIORITY 4 //the [priority] of submit, kept as a shorthand for nice values
+#define NICE_LEVELS 40 //nice values -20 to 19
+#define MAX_REPORT_COMMANDS 32
+#define SKETCH_BUCKETS 1024
+#define REPORT_METRICS 4
+#define SLOWDOWN_BOUND 10 //ms, jobs shorter than this are not punished by a large slowdown
+#define LOG_NAME ".simple_shell_log" //history log in the home directory, its pid index gets a .idx suffix
+#define LOG_MAGIC 0x53534c47 //"SSLG"
+#define LOG_INITIAL_CAPACITY 1024
+#define MAX_SESSIONS 16
+#define MAX_AFTER 4 //jobs a submitted job can wait for
+#define MAX_STAGES (MAX_COMMANDS-1) //earlier stages of a pipeline run by the scheduler
+#define INDEX_ENTRY(slot, stage) ((slot) * (MAX_STAGES+1) + (stage) + 1) //pid index entry, stage 0 is the last stage
+#define MAX_REQUESTS 32
+#define REQUEST_RENICE 0 //change the nice value of a job
+#define REQUEST_RELEASE 1 //take a job out of the scheduler and let it run
+#define PROMPT "\033[1;35mos@shell:~$\033[0m "
+#define SPOOL_DIR "/tmp/simple_shell_spool" //prefix of a directory per shell, the output of a spooled job is in a file named by its pid
+#define SPOOL_OFF 0 //submitted jobs write to the terminal
+#define SPOOL_ON 1 //submitted jobs write to their spool file, read with cat-job and tail-job
+#define SPOOL_STREAM 2 //spooled output of finished jobs is also printed at the prompt in submission order
+#define TAIL_LINES 10
+#define REGISTRY_NAME "shm" //host-wide segment through which shells find the scheduler
+#define REGISTRY_MAGIC 0x53524547 //"SREG"
+#define SCHEDULER_START_S 2 //seconds a started scheduler has to write its pid before a shell starts another one
 
 //struct to store process info
 struct Process{
-    int pid, priority;
+    int pid, nice; //nice is -20 to 19 as for the kernel, the job's share of the cpu is given by its weight
     bool submit,queue,completed; // flags
     // submit: process have been submitted
-    // queue: process is in the scheduler's queue
+    // queue: process is in the scheduler's queues, cleared once the scheduler has let go of it after it exited
     // completed: indicates if process have been completed
     char command[MAX_SIZE + 1]; //+1 to accomodate \n or \0
     struct timeval start;
     unsigned long execution_time, wait_time, vruntime;
+    int exit_status; //status from wait4, valid once completed
+    struct rusage usage; //resources used by the process (all stages for a pipeline)
+    long log_index; //record of this process in the history log
+    int group; //session of the process in the scheduler, written by the scheduler
+    long rss_kb; //largest resident set seen while the job ran, its working set, written by the scheduler
+    unsigned long cpu_ticks; //cpu time of the job in clock ticks when it was last resumed, written by the scheduler
+    bool blocked; //job was sleeping or waiting on io at the last check, its cpu is lent out, written by the scheduler
+    int seq; //sequence number of the command in its shell
+    int after[MAX_AFTER], after_count; //sequence numbers of the jobs which have to exit successfully before this one is admitted
+    int dependents; //jobs submitted to wait for this one
+    long hint_ms; //expected cpu time from earlier runs of the same command, 0 if unknown
+    unsigned long path_ms; //expected time left on the longest chain of jobs waiting on this one, written by the scheduler
+    int heap_index; //position in its ready queue while it is queued, written by the scheduler
+    bool released; //taken out of the scheduler by fg or bg, it runs on its own until it exits
+    bool cancelled; //killed before it ever ran because a job it waits for failed, its time is all waiting
+    bool interactive; //foreground command run by the scheduler, the shell is waiting for it
+    int stage_pids[MAX_STAGES], stage_count; //earlier stages of a pipeline, signalled with pid
+    int unreaped; //processes of a pipeline not reaped yet, it completes when the last of them is
+    bool spooled; //stdout and stderr of the job go to its spool file instead of the terminal
+};
+
+//change to a job asked for by the shell, the scheduler owns the queues so it applies them
+struct request{
+    int type; //REQUEST_RENICE or REQUEST_RELEASE
+    int slot, nice;
 };
 
 //history struct used to store the history of process executions
 struct history_struct {
-    int history_count,ncpu,tslice;
-    sem_t mutex; // semaphore
+    int history_count,ncpu,tslice; //history_count is the number of commands so far, the last MAX_HISTORY are kept
+    pthread_mutex_t mutex; //robust and shared with the scheduler, a lock whose owner died is taken over
+    int request_count; //requests the scheduler applies at its next check
+    struct request requests[MAX_REQUESTS];
+    int pid_index[PID_BUCKETS]; //open addressing hash from the pids of a command to an entry for its slot and stage, 0 is an empty bucket
     struct Process history[MAX_HISTORY];
 };
 
+//a shell attached to the scheduler, its history_struct is in the segment "shm.<shell_pid>"
+struct session{
+    int shell_pid; //0 if the entry is free
+    bool leaving; //set by the shell when it exits
+};
+
+//host-wide registry of the scheduler and the shells using it
+struct registry{
+    int magic;
+    bool ready; //set once the creating shell has initialised the registry
+    int scheduler_pid, ncpu, tslice;
+    bool auto_slots; //ncpu is an upper bound and the scheduler adapts the cpus it uses to the load
+    int workers; //threads which stop and resume jobs, 0 or 1 does it all in the scheduler thread
+    long launched; //time in seconds at which a shell last started the scheduler, scheduler_pid is -1 until it runs
+    pthread_mutex_t mutex; //robust, a shell or scheduler dying while it holds it does not block the others
+    struct session sessions[MAX_SESSIONS];
+};
+
+//struct to store a job started by the parallel builtin
+struct parallel_job{
+    int pid, status, out_fd;
+    bool done;
+    struct timeval start;
+    unsigned long run_time;
+};
+
+//streaming quantile sketch, log-linear buckets with 16 sub-buckets per power of two (about 6% error)
+struct sketch{
+    unsigned long count;
+    double sum;
+    unsigned int buckets[SKETCH_BUCKETS];
+};
+
+//statistics of a group of completed jobs (a priority, a command or every job)
+//metrics are turnaround, wait and cpu time in ms and slowdown scaled by 100
+struct report_group{
+    char name[MAX_SIZE+1];
+    struct sketch metrics[REPORT_METRICS];
+    double share_sum, share_sq; //sums of cpu time/turnaround for jain's fairness index
+};
+
+//fixed-size record of a command in the history log, appended when the command is entered
+//and updated in place when it completes, so records are in order of start time
+struct log_record{
+    long start_ms, end_ms; //wall clock time in ms since the epoch
+    int session; //pid of the shell that ran the command
+    int pid, nice, exit_status;
+    long prev_same_pid; //older record with the same pid, -1 if there is none
+    bool submit, completed;
+    unsigned long execution_time, wait_time;
+    long user_ms, system_ms, max_rss, context_switches;
+    char command[MAX_SIZE+1];
+};
+
+//header of the history log, followed by capacity records of which count are in use
+struct log_header{
+    int magic, record_size;
+    long count, capacity;
+};
+
+//header of the pid index, followed by an open addressing table of record numbers (newest record for a pid, -1 if empty)
+struct index_header{
+    long count; //records of the log covered by the index
+    long pids, buckets; //distinct pids in the table and its size, a power of two
+};
+
 //function declarations
 static void sigint_handler(int signum);
-static void sigchld_handler(int signum, siginfo_t *info, void *context);
 void termination_report();
 void shell_loop();
 char* read_user_input();
@@ -49,19 +182,107 @@ int create_child_process(char *command, int input_fd, int output_fd);
 void start_time(struct timeval *start);
 unsigned long end_time(struct timeval *start);
 int submit_process(char *command);
+int submit_batch(char *command);
+int parse_job(char *job, char **arguments, struct Process *proc);
+int parse_after(char *list, struct Process *proc);
+struct Process *find_job(int pid);
+int index_pid(int entry);
+void pid_index_insert(struct Process *proc);
+void pid_index_remove(struct Process *proc);
+bool recycle_slot(int seq);
+bool slotless_command(char *command);
+bool job_control(char *command);
+int signal_stages(struct Process *proc, int sig);
+bool request_job(int type, struct Process *proc, int nice);
+void wait_job(struct Process *proc);
+int spool_command(char *command);
+void spool_path(int pid, char *path, size_t size);
+void spool_output(int pid, int lines);
+int stream_spool();
+void spool_cleanup();
+int spawn_job(char **arguments);
+int set_pipe_size(int fd);
+long splice_all(int in_fd, int out_fd);
+int splice_n(int in_fd, int out_fd, ssize_t n);
+int splice_builtin(char **arguments);
+int parallel(char *command);
+void wait_sigchld();
+void reap_children();
+void record_exit(int pid, int status, struct rusage *usage);
+void add_usage(struct rusage *total, struct rusage *usage);
+void report_job(struct Process *proc);
+void sketch_add(struct sketch *sk, unsigned long value);
+unsigned long sketch_quantile(struct sketch *sk, double q);
+void print_group(struct report_group *group);
+void analytics_report();
+int report_command(char *command);
+void command_name(char *command, char *name);
+long command_hint(char *command);
+void write_escaped(FILE *file, char *str, char quote);
+void log_open();
+void log_close();
+void log_map(int fd, void **map, size_t *size, size_t new_size);
+void log_refresh();
+long log_append(struct Process *proc);
+void log_launched(struct Process *proc);
+void log_update(struct Process *proc);
+void index_insert(long record);
+void index_rebuild(long buckets);
+struct log_record *log_find_pid(int pid);
+long log_lower_bound(long ms);
+long now_ms();
+void print_record(struct log_record *record);
+int history_command(char *command);
+void attach_scheduler();
+void detach_scheduler();
+void launch_scheduler();
+bool scheduler_alive();
+void supervise_scheduler();
+void init_mutex(pthread_mutex_t *mutex);
+int lock_mutex(pthread_mutex_t *mutex);
+int lock_table();
+int unlock_table();
+int host_cpus();
 
 //global variables
-int shm_fd, scheduler_pid;
+int shm_fd;
+int sigchld_fd; //signalfd on which the shell receives SIGCHLD instead of a handler
+sigset_t child_mask; //signal mask restored in children, SIGCHLD stays blocked only in the shell
+struct report_group report_total, report_nice[NICE_LEVELS+1], report_commands[MAX_REPORT_COMMANDS];
+int report_command_count = 0;
+struct timeval session_start, last_completion;
+FILE *record_file = NULL; //per job records are streamed here as they complete
+bool record_json = false;
+int log_fd = -1, index_fd = -1;
+struct log_header *log_map_header; //history log and its pid index, mapped in full
+struct index_header *index_map_header;
+size_t log_size = 0, index_size = 0;
+int session_id;
+long log_session_first; //records before this one were written before the shell started
+int batch_slots = 1; //number of history slots filled by the last command (more than 1 for bulk submit)
+bool batch_hidden = false; //the slots of a bulk submit are marked completed until shell_loop publishes them
+int pipe_size = 0; //capacity in bytes for pipes between pipeline stages, 0 keeps the kernel default
 struct history_struct *process_table;
+struct registry *registry;
+int registry_fd;
+char shm_name[32]; //this shell's segment, the registry refers to it by the shell pid
+bool auto_ncpu = false; //NCPU was given as auto
+bool managed = false; //commands and background commands are run by the scheduler like submitted jobs
+bool foreground_job = false; //the last command is a managed foreground command, shell_loop waits for it
+int dispatch_workers = 0; //threads the scheduler stops and resumes jobs with when this shell starts it
+int spool_mode = SPOOL_OFF;
+char spool_dir[64]; //this shell's spool directory, created when spooling is turned on
+int stream_next = 0; //sequence number of the first command whose output has not been streamed yet
 
 int main(int argc, char** argv){
-    if (argc != 3){
-        printf("Usage: %s <NCPU> <TIME_QUANTUM>\n",argv[0]);
+    if (argc != 3 && argc != 4){
+        printf("Usage: %s <NCPU|auto> <TIME_QUANTUM> [WORKERS]\n",argv[0]);
         exit(1);
     }
     // shared memory initialisation
-    // creating a new shared memory object using "shm_open"
-    shm_fd = shm_open("shm", O_CREAT|O_RDWR, 0666);
+    // creating a new shared memory object using "shm_open", every shell has its own
+    snprintf(shm_name, sizeof(shm_name), "%s.%d", REGISTRY_NAME, getpid());
+    shm_fd = shm_open(shm_name, O_CREAT|O_RDWR|O_TRUNC, 0666);
     if (shm_fd == -1){
         perror("shm_open");
         exit(1);
@@ -79,53 +300,41 @@ int main(int argc, char** argv){
     }
 
     process_table->history_count=0;
-    process_table->ncpu = atoi(argv[1]);
-    if (process_table->ncpu == 0){
-        printf("invalid argument for number of CPU\n");
-        exit(1);
+    //auto takes every cpu this shell may use as the upper bound and lets the scheduler adapt to the load
+    int cpus = host_cpus();
+    if (strcmp(argv[1], "auto") == 0){
+        auto_ncpu = true;
+        process_table->ncpu = cpus;
+    }
+    else{
+        process_table->ncpu = atoi(argv[1]);
+        if (process_table->ncpu == 0){
+            printf("invalid argument for number of CPU\n");
+            exit(1);
+        }
+        if (process_table->ncpu > cpus){
+            printf("warning: %d CPUs requested but only %d are available\n", process_table->ncpu, cpus);
+        }
     }
     process_table->tslice = atoi(argv[2]);
     if (process_table->tslice == 0){
         printf("invalid argument for time quantum\n");
         exit(1);
     }
-    // initialising a semaphore
-    if (sem_init(&process_table->mutex, 1, 1) == -1){  
-        perror("sem_init");
-        exit(1);
-    }
-
-    printf("Initializing simple scheduler...\n");
-    // forking a child process for the scheduler
-    pid_t pid;
-    if ((pid= fork())<0){
-        printf("fork() failed.\n");
-        perror("fork");
-        exit(1);
-    }
-    if (pid == 0){
-        if (execvp("./scheduler",("./scheduler",NULL)) == -1) {
-            printf("Couldn't initiate scheduler.\n");
-            exit(1);
-        }
-        if (munmap(process_table, sizeof(struct history_struct)) < 0){
-            printf("Error unmapping\n");
-            perror("munmap");
-            exit(1);
-        }
-        if (close(shm_fd) == -1){
-            perror("close");
+    if (argc == 4){
+        dispatch_workers = atoi(argv[3]);
+        if (dispatch_workers < 1){
+            printf("invalid argument for number of workers\n");
             exit(1);
         }
-        exit(0);
-    }
-    else{
-        scheduler_pid = pid;
     }
+    init_mutex(&process_table->mutex);
+
+    attach_scheduler();
 
     //signal handling
     //sigint handler
-    struct sigaction s_int, s_chld;
+    struct sigaction s_int;
     if (memset(&s_int, 0, sizeof(s_int)) == 0){
         perror("memset");
         exit(1);
@@ -136,28 +345,40 @@ int main(int argc, char** argv){
         exit(1);
     }
 
-    if (memset(&s_chld, 0, sizeof(s_chld)) == 0){
-        perror("memset");
+    //SIGCHLD is blocked and read from a signalfd in the shell loop, children are reaped there
+    sigset_t sigchld_mask;
+    sigemptyset(&sigchld_mask);
+    sigaddset(&sigchld_mask, SIGCHLD);
+    if (sigprocmask(SIG_BLOCK, &sigchld_mask, &child_mask) == -1){
+        perror("sigprocmask");
         exit(1);
     }
-    //sigchld handler
-    s_chld.sa_sigaction = sigchld_handler;
-    s_chld.sa_flags = SA_SIGINFO|SA_NOCLDSTOP|SA_RESTART;
-    if (sigaction(SIGCHLD, &s_chld, NULL) == -1){
-        perror("sigaction");
+    sigchld_fd = signalfd(-1, &sigchld_mask, SFD_NONBLOCK|SFD_CLOEXEC);
+    if (sigchld_fd == -1){
+        perror("signalfd");
         exit(1);
     }
+    //stdin is read unbuffered so that poll on it never misses a line already sitting in a stdio buffer
+    setvbuf(stdin, NULL, _IONBF, 0);
 
+    log_open();
     printf("Initializing simple shell...\n");
+    start_time(&session_start);
+    last_completion = session_start;
     shell_loop();
     printf("Exiting simple shell...\n");
 
+    reap_children();
+    stream_spool();
     termination_report();
-    // destroying the semaphore
-    if (sem_destroy(&process_table->mutex) == -1){
-        perror("shm_destroy");
-        exit(1);
+    analytics_report();
+    if (record_file != NULL){
+        fclose(record_file);
     }
+    log_close();
+    spool_cleanup();
+    detach_scheduler();
+    // the mutex is not destroyed, the scheduler takes it until it has let go of this shell
     // unmapping shared memory segment followed by a "close" call
     if (munmap(process_table, sizeof(struct history_struct)) < 0){
         printf("Error unmapping\n");
@@ -169,7 +390,7 @@ int main(int argc, char** argv){
         exit(1);
     }
     // parent deletes the shared memory object by using "shm_unlink"
-    if (shm_unlink("shm") == -1){
+    if (shm_unlink(shm_name) == -1){
         perror("shm_unlink");
         exit(1);
     }
@@ -180,20 +401,17 @@ int main(int argc, char** argv){
 static void sigint_handler(int signum) {
     if(signum == SIGINT) {
         printf("\nCaught SIGINT signal for termination\n");
-        printf("Terminating simple scheduler...\n");
-        //send sigint to scheduler
-        if (kill(scheduler_pid, SIGINT) == -1){
-            perror("kill");
-            exit(1);
-        }
         // clean up and program termination
         printf("Exiting simple shell...\n");
         termination_report();
-
-        if (sem_destroy(&process_table->mutex) == -1){
-            perror("shm_destroy");
-            exit(1);
+        analytics_report();
+        if (record_file != NULL){
+            fclose(record_file);
         }
+        log_close();
+        spool_cleanup();
+        detach_scheduler();
+
         if (munmap(process_table, sizeof(struct history_struct)) < 0){
             printf("Error unmapping\n");
             perror("munmap");
@@ -203,7 +421,7 @@ static void sigint_handler(int signum) {
             perror("close");
             exit(1);
         }
-        if (shm_unlink("shm") == -1){
+        if (shm_unlink(shm_name) == -1){
             perror("shm_unlink");
             exit(1);
         }
@@ -211,49 +429,122 @@ static void sigint_handler(int signum) {
     }
 }
 
-// This is a signal handler for SIGCHLD. It handles the termination of child processes, 
-// updates information in the history table, and synchronizes access using a semaphore.
-static void sigchld_handler(int signum, siginfo_t *info, void *context){
-    if(signum == SIGCHLD){
-        pid_t sender_pid = info->si_pid;
-        if (sender_pid != scheduler_pid){
-            if (sem_wait(&process_table->mutex) == -1){
-                perror("sem_wait");
-                exit(1);
+//blocks until a SIGCHLD is pending on the signalfd and consumes every queued one
+//SIGCHLD is not queued per child, so callers always reap with wait4 until nothing is left
+//it also returns after a time quantum without one, once it has checked that the scheduler is still there
+void wait_sigchld(){
+    struct pollfd fds = {sigchld_fd, POLLIN, 0};
+    struct signalfd_siginfo info;
+    int ready;
+    while ((ready = poll(&fds, 1, process_table->tslice)) == -1){
+        if (errno != EINTR){
+            perror("poll");
+            exit(1);
+        }
+    }
+    if (ready == 0){
+        supervise_scheduler();
+        return;
+    }
+    while (read(sigchld_fd, &info, sizeof(info)) == sizeof(info));
+}
+
+//reaps every child that has exited so far and records it in the history table
+void reap_children(){
+    int pid, status;
+    struct rusage usage;
+    struct signalfd_siginfo info;
+    while (read(sigchld_fd, &info, sizeof(info)) == sizeof(info));
+    while ((pid = wait4(-1, &status, WNOHANG, &usage)) > 0){
+        record_exit(pid, status, &usage);
+    }
+}
+
+//updates information in the history table for a reaped child and synchronizes access using the table mutex
+//every stage of a pipeline adds its resource usage, the pipeline completes once all of them have been reaped
+//and its exit status is the one of the last stage
+void record_exit(int pid, int status, struct rusage *usage){
+    struct Process done = {.completed = false};
+    if (lock_table() == -1){
+        perror("pthread_mutex_lock");
+        exit(1);
+    }
+    struct Process *proc = find_job(pid);
+    if (proc != NULL && !proc->completed){
+        add_usage(&proc->usage, usage);
+        if (pid == proc->pid){
+            proc->exit_status = status;
+        }
+        if (--proc->unreaped <= 0){
+            if (proc->cancelled){
+                proc->wait_time += end_time(&proc->start);
             }
-            for (int i=0; i<process_table->history_count; i++){
-                if (process_table->history[i].pid == sender_pid){
-                    process_table->history[i].execution_time += end_time(&process_table->history[i].start);
-                    process_table->history[i].completed = true;
-                    break;
-                }
+            else if (proc->submit){
+                proc->execution_time += end_time(&proc->start);
             }
-            if (sem_post(&process_table->mutex) == -1){
-                perror("sem_post");
-                exit(1);
+            else{
+                //background command, its execution time is the wall time since it was launched
+                proc->execution_time = end_time(&proc->start);
             }
+            proc->completed = true;
+            done = *proc;
+        }
+    }
+    if (unlock_table() == -1){
+        perror("pthread_mutex_unlock");
+        exit(1);
+    }
+    //a cancelled job never ran, it is logged but left out of the statistics
+    if (done.completed){
+        log_update(&done);
+        if (!done.cancelled){
+            report_job(&done);
         }
     }
 }
 
+//adds the resource usage of one process to a total, max rss is the largest of them
+void add_usage(struct rusage *total, struct rusage *usage){
+    timeradd(&total->ru_utime, &usage->ru_utime, &total->ru_utime);
+    timeradd(&total->ru_stime, &usage->ru_stime, &total->ru_stime);
+    if (usage->ru_maxrss > total->ru_maxrss){
+        total->ru_maxrss = usage->ru_maxrss;
+    }
+    total->ru_minflt += usage->ru_minflt;
+    total->ru_majflt += usage->ru_majflt;
+    total->ru_nvcsw += usage->ru_nvcsw;
+    total->ru_nivcsw += usage->ru_nivcsw;
+}
+
 //the function called upon termination to print command details
 //in here we are formatting time and printing iterating over the global array
+//the rows come from this session's records in the history log, which are brought up to date first
 void termination_report(){
-    if (sem_wait(&process_table->mutex) == -1){
-        perror("sem_wait");
+    if (lock_table() == -1){
+        perror("pthread_mutex_lock");
+        exit(1);
+    }
+    int first = process_table->history_count > MAX_HISTORY ? process_table->history_count - MAX_HISTORY : 0;
+    for (int seq=first; seq<process_table->history_count; seq++){
+        log_update(&process_table->history[SLOT(seq)]);
+    }
+    if (unlock_table() == -1){
+        perror("pthread_mutex_unlock");
         exit(1);
     }
     if (process_table->history_count > 0){
         //PID is -1 if a command was not executed through process creation
-        printf("\nCommand\t\tPID\t\tExecution_time\t\tWaiting_time\n");
-        for (int i=0; i<process_table->history_count; i++){
-            printf("%s\t\t%d\t\t%ldms\t\t%ldms\n",process_table->history[i].command,process_table->history[i].pid,process_table->history[i].execution_time,process_table->history[i].wait_time);
+        //user and system times are cpu times from rusage, context switches are voluntary+involuntary
+        printf("\nCommand\t\tPID\t\tExecution_time\t\tWaiting_time\t\tUser_time\t\tSystem_time\t\tMax_RSS\t\tContext_switches\n");
+        log_refresh();
+        struct log_record *records = (struct log_record *)(log_map_header + 1);
+        for (long i=log_session_first; i<log_map_header->count; i++){
+            if (records[i].session == session_id){
+                printf("%s\t\t%d\t\t%ldms\t\t%ldms\t\t%ldms\t\t%ldms\t\t%ldKB\t\t%ld\n",records[i].command,records[i].pid,records[i].execution_time,records[i].wait_time,
+                    records[i].user_ms, records[i].system_ms, records[i].max_rss, records[i].context_switches);
+            }
         }
     }
-    if (sem_post(&process_table->mutex) == -1){
-        perror("sem_post");
-        exit(1);
-    }
 }
 
 //infinite loop for the shell
@@ -261,41 +552,133 @@ void termination_report(){
 void shell_loop(){
     int status;
     do{
+        stream_spool();
         //this prints the output in magenta colour
-        printf("\033[1;35mos@shell:~$\033[0m ");
+        printf(PROMPT);
         char* command = read_user_input();
-        if (sem_wait(&process_table->mutex) == -1){
-            perror("sem_wait");
+        if (lock_table() == -1){
+            perror("pthread_mutex_lock");
             exit(1);
         }
-        process_table->history[process_table->history_count].pid = -1;
-        process_table->history[process_table->history_count].submit = false;
-        process_table->history[process_table->history_count].wait_time = process_table->history[process_table->history_count].execution_time = process_table->history[process_table->history_count].vruntime = 0;
-        start_time(&process_table->history[process_table->history_count].start);
-        if (sem_post(&process_table->mutex) == -1){
-            perror("sem_post");
+        if (!recycle_slot(process_table->history_count)){
+            bool slotless = slotless_command(command);
+            if (unlock_table() == -1){
+                perror("pthread_mutex_unlock");
+                exit(1);
+            }
+            //builtins which start no process still run, they are just not recorded
+            if (slotless){
+                batch_slots = 0;
+                status = launch(command);
+                continue;
+            }
+            printf("the oldest of the last %d commands is still running, wait for it to complete\n", MAX_HISTORY);
+            status = 1;
+            continue;
+        }
+        strcpy(process_table->history[SLOT(process_table->history_count)].command,command);
+        process_table->history[SLOT(process_table->history_count)].seq = process_table->history_count;
+        process_table->history[SLOT(process_table->history_count)].dependents = 0;
+        process_table->history[SLOT(process_table->history_count)].queue = false;
+        process_table->history[SLOT(process_table->history_count)].pid = -1;
+        process_table->history[SLOT(process_table->history_count)].submit = false;
+        process_table->history[SLOT(process_table->history_count)].completed = false;
+        process_table->history[SLOT(process_table->history_count)].exit_status = 0;
+        process_table->history[SLOT(process_table->history_count)].rss_kb = 0;
+        process_table->history[SLOT(process_table->history_count)].after_count = 0;
+        process_table->history[SLOT(process_table->history_count)].nice = 0;
+        process_table->history[SLOT(process_table->history_count)].interactive = false;
+        process_table->history[SLOT(process_table->history_count)].stage_count = 0;
+        process_table->history[SLOT(process_table->history_count)].unreaped = 0;
+        process_table->history[SLOT(process_table->history_count)].spooled = false;
+        memset(&process_table->history[SLOT(process_table->history_count)].usage, 0, sizeof(struct rusage));
+        process_table->history[SLOT(process_table->history_count)].wait_time = process_table->history[SLOT(process_table->history_count)].execution_time = process_table->history[SLOT(process_table->history_count)].vruntime = 0;
+        start_time(&process_table->history[SLOT(process_table->history_count)].start);
+        //the command is in the history log from the moment it is entered, its pid is filled in once it is known
+        process_table->history[SLOT(process_table->history_count)].log_index = command[strspn(command, " \t")] == '\0' ? -1 : log_append(&process_table->history[SLOT(process_table->history_count)]);
+        if (unlock_table() == -1){
+            perror("pthread_mutex_unlock");
             exit(1);
         }
 
+        batch_slots = 1;
         status = launch(command);
-        if (sem_wait(&process_table->mutex) == -1){
-            perror("sem_wait");
+        if (lock_table() == -1){
+            perror("pthread_mutex_lock");
             exit(1);
         }
-        if(!process_table->history[process_table->history_count].submit){
-            process_table->history[process_table->history_count].execution_time = end_time(&process_table->history[process_table->history_count].start);
+        struct Process done = process_table->history[SLOT(process_table->history_count)];
+        if(!process_table->history[SLOT(process_table->history_count)].submit){
+            done.execution_time = process_table->history[SLOT(process_table->history_count)].execution_time = end_time(&process_table->history[SLOT(process_table->history_count)].start);
+        }
+        //completing the record of the command, the other jobs of a batch get their own records,
+        //and adding them to the pid index
+        for (int i=0; i<batch_slots; i++){
+            struct Process *proc = &process_table->history[SLOT(process_table->history_count+i)];
+            if (batch_hidden){
+                proc->completed = proc->pid == -1;
+            }
+            if (i == 0){
+                log_launched(proc);
+            }
+            else{
+                proc->log_index = log_append(proc);
+            }
+            pid_index_insert(proc);
         }
-        process_table->history_count++;
-        if (sem_post(&process_table->mutex) == -1){
-            perror("sem_post");
+        //publishing the command (or the whole batch of submitted jobs) to the scheduler at once
+        process_table->history_count += batch_slots;
+        batch_hidden = false;
+        if (unlock_table() == -1){
+            perror("pthread_mutex_unlock");
             exit(1);
         }
+        //a managed foreground command is waited for once the scheduler can see it
+        if (foreground_job){
+            foreground_job = false;
+            wait_job(&process_table->history[SLOT(process_table->history_count - 1)]);
+        }
+        //foreground commands are complete here, background and submitted ones when they are reaped
+        if (!done.submit && done.completed && done.pid != -1){
+            done.log_index = process_table->history[SLOT(process_table->history_count - batch_slots)].log_index;
+            log_update(&done);
+            report_job(&done);
+        }
     } while(status);
 }
 
 //here we take input and remove trailing \n and update global array
 char* read_user_input(){
     static char input[MAX_SIZE+1];
+    //waiting for input while reaping children as their SIGCHLD arrives
+    struct pollfd fds[2] = {{STDIN_FILENO, POLLIN, 0}, {sigchld_fd, POLLIN, 0}};
+    fflush(stdout);
+    while (true){
+        int ready = poll(fds, 2, process_table->tslice);
+        if (ready == -1){
+            if (errno == EINTR){
+                continue;
+            }
+            perror("poll");
+            exit(1);
+        }
+        if (ready == 0){
+            //the scheduler is checked on every time quantum, one that died is started again
+            supervise_scheduler();
+            continue;
+        }
+        if (fds[1].revents & POLLIN){
+            reap_children();
+            //output of jobs finished meanwhile is printed above a fresh prompt
+            if (stream_spool() > 0){
+                printf(PROMPT);
+                fflush(stdout);
+            }
+        }
+        if (fds[0].revents){
+            break;
+        }
+    }
     if (fgets(input,MAX_SIZE+1,stdin) == NULL){
         perror("fgets");
         exit(1);
@@ -304,15 +687,6 @@ char* read_user_input(){
     if (input_len>0 && input[input_len-1]=='\n'){
         input[input_len-1] = '\0';
     }
-    if (sem_wait(&process_table->mutex) == -1){
-        perror("sem_wait");
-        exit(1);
-    }
-    strcpy(process_table->history[process_table->history_count].command,input);
-    if (sem_post(&process_table->mutex) == -1){
-        perror("sem_post");
-        exit(1);
-    }
     return input;
 }
 
@@ -329,59 +703,123 @@ int launch(char* command){
         end--;
     }
 
+    if (strncmp(command, "submit -n ", 10) == 0 || strncmp(command, "submit -f ", 10) == 0){
+        return submit_batch(command);
+    }
+
     if (strncmp(command, "submit", 6) == 0) {
         // Check if the priority is specified
-        if (sem_wait(&process_table->mutex) == -1){
-            perror("sem_wait");
+        if (lock_table() == -1){
+            perror("pthread_mutex_lock");
             exit(1);
         }
-        process_table->history[process_table->history_count].submit = true;
-        process_table->history[process_table->history_count].completed = false;
-        process_table->history[process_table->history_count].priority = 1;
-        process_table->history[process_table->history_count].queue = false;
-        process_table->history[process_table->history_count].pid = submit_process(command);
-        start_time(&process_table->history[process_table->history_count].start);
-        if (sem_post(&process_table->mutex) == -1){
-            perror("sem_post");
+        process_table->history[SLOT(process_table->history_count)].submit = true;
+        process_table->history[SLOT(process_table->history_count)].completed = false;
+        process_table->history[SLOT(process_table->history_count)].queue = false;
+        process_table->history[SLOT(process_table->history_count)].released = false;
+        process_table->history[SLOT(process_table->history_count)].cancelled = false;
+        process_table->history[SLOT(process_table->history_count)].pid = submit_process(command);
+        start_time(&process_table->history[SLOT(process_table->history_count)].start);
+        if (unlock_table() == -1){
+            perror("pthread_mutex_unlock");
             exit(1);
         }
         return 1;
     }
 
-    if (strcmp(command,"history") == 0){
-        if (sem_wait(&process_table->mutex) == -1){
-            perror("sem_wait");
+    if (strncmp(command,"history",7) == 0 && (command[7] == ' ' || command[7] == '\0')){
+        return history_command(command);
+    }
+
+    if (strcmp(command,"jobs") == 0){
+        if (lock_table() == -1){
+            perror("pthread_mutex_lock");
             exit(1);
         }
-        for (int i=0; i<process_table->history_count+1; i++){
-            printf("%s\n",process_table->history[i].command);
+        //jobs of this session in the history log which have not completed yet
+        log_refresh();
+        struct log_record *records = (struct log_record *)(log_map_header + 1);
+        for (long i=log_session_first; i<log_map_header->count; i++){
+            if (records[i].session == session_id && records[i].submit && !records[i].completed){
+                printf("%d\t%d\t%s\n",records[i].pid,records[i].nice,records[i].command);
+            }
         }
-        if (sem_post(&process_table->mutex) == -1){
-            perror("sem_post");
+        if (unlock_table() == -1){
+            perror("pthread_mutex_unlock");
             exit(1);
         }
         return 1;
     }
 
-    if (strcmp(command,"jobs") == 0){
-        if (sem_wait(&process_table->mutex) == -1){
-            perror("sem_wait");
-            exit(1);
-        }
-        for (int i=0; i<process_table->history_count; i++){
-            if (process_table->history[i].submit==true && process_table->history[i].completed==false){
-                printf("%d\t%d\t%s\n",process_table->history[i].pid,process_table->history[i].priority,process_table->history[i].command);
+    //kill of a pid which is not a job of this shell is left to the kill program
+    if (job_control(command)){
+        return 1;
+    }
+
+    if (strncmp(command, "pipesize", 8) == 0 && (command[8] == ' ' || command[8] == '\0')){
+        if (command[8] == ' '){
+            char *end;
+            long size = strtol(command + 9, &end, 10);
+            if (end == command + 9 || *end != '\0' || size < 0 || size > INT_MAX){
+                printf("usage: pipesize [bytes]\n");
+                return 1;
+            }
+            //the size is tried on a pipe once here, so a size the kernel refuses is not reported on every pipeline
+            int test[2];
+            if (pipe(test) == -1){
+                perror("pipe");
+                exit(1);
             }
+            int actual = size > 0 ? fcntl(test[1], F_SETPIPE_SZ, (int) size) : 0;
+            if (actual == -1){
+                perror("pipesize");
+            }
+            else{
+                //the kernel rounds the size up to a power of two pages
+                pipe_size = actual;
+            }
+            close(test[0]);
+            close(test[1]);
         }
-        if (sem_post(&process_table->mutex) == -1){
-            perror("sem_post");
-            exit(1);
+        if (pipe_size > 0){
+            printf("pipe size is %d bytes\n", pipe_size);
+        }
+        else{
+            printf("pipe size is the kernel default\n");
         }
         return 1;
     }
 
+    if (strncmp(command, "managed", 7) == 0 && (command[7] == ' ' || command[7] == '\0')){
+        if (strcmp(command + 7, " on") == 0){
+            managed = true;
+        }
+        else if (strcmp(command + 7, " off") == 0){
+            managed = false;
+        }
+        else if (command[7] != '\0'){
+            printf("usage: managed [on|off]\n");
+            return 1;
+        }
+        printf("commands are %s\n", managed ? "run by the scheduler" : "run directly");
+        return 1;
+    }
+
+    if ((strncmp(command, "spool", 5) == 0 && (command[5] == ' ' || command[5] == '\0'))
+        || strncmp(command, "cat-job ", 8) == 0 || strncmp(command, "tail-job ", 9) == 0){
+        return spool_command(command);
+    }
+
+    if (strncmp(command, "parallel ", 9) == 0){
+        return parallel(command);
+    }
+
+    if (strncmp(command, "report", 6) == 0 && (command[6] == ' ' || command[6] == '\0')){
+        return report_command(command);
+    }
+
     if (strcmp(command, "") == 0){
-        process_table->history_count--;
+        batch_slots = 0;
         return 1;
     }
     if (strcmp(command,"exit") == 0){
@@ -408,25 +846,40 @@ int create_process_and_run(char* command){
         return 1;
     }
 
+    //flushing pending output so that children do not inherit and repeat it
+    fflush(stdout);
+
     //executing if pipe is present in command input except the last one 
     int i, prev_read = STDIN_FILENO;
     int pipes[2], child_pids[command_count];
     //we iterate and execute every command through process creation and keep updating read and write ends of pipe
     for (i=0; i < command_count-1; i++){
-        if (pipe(pipes) == -1){
+        //close on exec, so a stage does not keep the read end of its own output pipe open
+        if (pipe2(pipes, O_CLOEXEC) == -1){
             perror("pipe");
             exit(1);
         }
+        set_pipe_size(pipes[1]);
 
         if ((child_pids[i]=create_child_process(commands[i], prev_read, pipes[1])) < 0){
             perror("create_child_process");
             exit(1);
         }
+        //a managed command is stopped until the scheduler dispatches it
+        if (managed && kill(child_pids[i], SIGSTOP) == -1){
+            perror("kill");
+            exit(1);
+        }
 
         if (close(pipes[1]) == -1){
             perror("close");
             exit(1);
         }
+        //the read end is only kept by the next stage, so a writer gets SIGPIPE once its reader has exited
+        if (prev_read != STDIN_FILENO && close(prev_read) == -1){
+            perror("close");
+            exit(1);
+        }
         prev_read = pipes[0];
     }
 
@@ -442,35 +895,86 @@ int create_process_and_run(char* command){
         perror("create_child_process");
         exit(1);
     }
+    if (managed && kill(child_pids[i], SIGSTOP) == -1){
+        perror("kill");
+        exit(1);
+    }
+    if (prev_read != STDIN_FILENO && close(prev_read) == -1){
+        perror("close");
+        exit(1);
+    }
     
     //updating global array for pids
-    if (sem_wait(&process_table->mutex) == -1){
-        perror("sem_wait");
+    if (lock_table() == -1){
+        perror("pthread_mutex_lock");
         exit(1);
     }
-    process_table->history[process_table->history_count].pid = child_pids[i];
-    if (sem_post(&process_table->mutex) == -1){
-        perror("sem_post");
+    //the last stage stands for the pipeline, the earlier ones are kept so they are signalled and accounted too
+    struct Process *proc = &process_table->history[SLOT(process_table->history_count)];
+    proc->pid = child_pids[i];
+    proc->stage_count = command_count-1;
+    memcpy(proc->stage_pids, child_pids, proc->stage_count * sizeof(int));
+    proc->unreaped = command_count;
+    //the record shows the pid while a foreground command runs
+    log_launched(proc);
+    if (managed){
+        //the command becomes a job of the scheduler
+        proc->submit = true;
+        proc->released = false;
+        proc->cancelled = false;
+        proc->interactive = !background_process;
+        proc->hint_ms = command_hint(proc->command);
+        start_time(&proc->start);
+    }
+    if (unlock_table() == -1){
+        perror("pthread_mutex_unlock");
         exit(1);
     }
+    if (managed){
+        foreground_job = !background_process;
+        if (background_process){
+            printf("%d %s\n", child_pids[command_count-1],command);
+        }
+        return 1;
+    }
     if (!background_process) {
-        //wait for child process if command is not background
-        for (i = 0; i < command_count; i++) {
-            int ret;
-            int pid = waitpid(child_pids[i], &ret, 0);
-            if (pid < 0) {
-                perror("waitpid");
-                exit(1);
-            }
-            if (!WIFEXITED(ret)){
-                printf("Abnormal termination of %d\n", pid);
+        //wait for child processes if command is not background, other children exiting meanwhile are recorded too
+        int remaining = command_count;
+        while (remaining > 0){
+            wait_sigchld();
+            int ret, pid;
+            struct rusage usage;
+            while ((pid = wait4(-1, &ret, WNOHANG, &usage)) > 0){
+                for (i = 0; i < command_count && child_pids[i] != pid; i++);
+                if (i == command_count){
+                    record_exit(pid, ret, &usage);
+                    continue;
+                }
+                remaining--;
+                if (!WIFEXITED(ret)){
+                    printf("Abnormal termination of %d\n", pid);
+                }
+                if (lock_table() == -1){
+                    perror("pthread_mutex_lock");
+                    exit(1);
+                }
+                add_usage(&proc->usage, &usage);
+                if (pid == child_pids[command_count-1]){
+                    proc->exit_status = ret;
+                }
+                if (unlock_table() == -1){
+                    perror("pthread_mutex_unlock");
+                    exit(1);
+                }
             }
         }
+        proc->completed = true;
     }
     else{
         //print pid and command if it is being executed in background
         printf("%d %s\n", child_pids[command_count-1],command);
     }
+    return 1;
 }
 
 int create_child_process(char *command, int input_fd, int output_fd){
@@ -481,6 +985,10 @@ int create_child_process(char *command, int input_fd, int output_fd){
     }
     else if (status == 0){
         //child process
+        if (sigprocmask(SIG_SETMASK, &child_mask, NULL) == -1){
+            perror("sigprocmask");
+            exit(1);
+        }
         //updating/copying I/O descriptors
         if (input_fd != STDIN_FILENO)
         {
@@ -515,6 +1023,14 @@ int create_child_process(char *command, int input_fd, int output_fd){
         }
         arguments[argument_count] = NULL;
 
+        //splice builtins move data between pipes and files inside the child without an exec
+        if (argument_count > 0){
+            int ret = splice_builtin(arguments);
+            if (ret != -1){
+                exit(ret);
+            }
+        }
+
         //exec to execute command (actual part of child process)
         if (execvp(arguments[0],arguments) == -1) {
             perror("execvp");
@@ -543,48 +1059,1772 @@ unsigned long end_time(struct timeval *start){
 }
 
 int submit_process(char *command){
-    int priority, status;
+    struct Process *proc = &process_table->history[SLOT(process_table->history_count)];
     //creating an array of indiviudal command and its arguments
     char* arguments[MAX_WORDS+1]; //+1 to accomodate NULL
+    proc->hint_ms = command_hint(command);
+    strtok(command, " "); //remove submit keyword from command
+    int argument_count = parse_job(NULL, arguments, proc);
+    if (argument_count < 0){
+        if (argument_count == -1){
+            printf("either invalid priority or you are passing arguments for a job");
+        }
+        proc->completed = true;
+        return -1;
+    }
+    proc->spooled = spool_mode != SPOOL_OFF;
+    return spawn_job(arguments);
+}
+
+//splits a job into its arguments and strips the optional leading --after <pid>[,<pid>...] and --nice <nice>
+//and the trailing priority, priority 1 to 4 is nice 0, 3, 5 and 6 (weights of about 1, 1/2, 1/3 and 1/4)
+//job is passed on to strtok, so NULL continues tokenizing the current string
+//returns -1 for an invalid priority or nice value and -2 for an invalid list of jobs to wait for
+int parse_job(char *job, char **arguments, struct Process *proc){
+    static int priority_nice[MAX_PRIORITY+1] = {0, 0, 3, 5, 6};
     int argument_count = 0;
-    char* token = strtok(command, " "); //remove submit keyword from command
-    token = strtok(NULL, " ");
-    while (token != NULL){
+    char* token = strtok(job, " ");
+    proc->nice = 0;
+    proc->after_count = 0;
+    while (token != NULL && strncmp(token, "--", 2) == 0){
+        char *value = strtok(NULL, " ");
+        if (strcmp(token, "--after") == 0){
+            if (parse_after(value, proc) == -1){
+                return -2;
+            }
+        }
+        else if (strcmp(token, "--nice") == 0 && value != NULL){
+            proc->nice = atoi(value);
+            if (proc->nice < -NICE_LEVELS/2 || proc->nice >= NICE_LEVELS/2){
+                return -1;
+            }
+        }
+        else{
+            return -1;
+        }
+        token = strtok(NULL, " ");
+    }
+    while (token != NULL && argument_count < MAX_WORDS){
         arguments[argument_count++] = token;
         token = strtok(NULL, " ");
     }
     //checking if priority is specified
     if (argument_count > 1){
-        priority = atoi(arguments[--argument_count]);
-        if (priority<1 || priority>4){
-            printf("either invalid priority or you are passing arguments for a job");
-            process_table->history[process_table->history_count].completed = true;
+        int priority = atoi(arguments[--argument_count]);
+        if (priority<1 || priority>MAX_PRIORITY){
             return -1;
         }
-        process_table->history[process_table->history_count].priority = priority;
+        proc->nice = priority_nice[priority];
     }
     arguments[argument_count] = NULL;
+    return argument_count;
+}
 
-    status = fork();
-    if (status < 0){
-        printf("fork() failed.\n");
+//resolves a comma separated list of pids to the slots of the jobs the submitted job waits for
+//only jobs which are already in this shell's table can be waited for, so the dependencies never form a cycle
+int parse_after(char *list, struct Process *proc){
+    char *next = list;
+    while (next != NULL && *next != '\0'){
+        struct Process *parent = find_job((int) strtol(next, &next, 10));
+        if (parent == NULL || parent->seq >= proc->seq || (*next != ',' && *next != '\0') || proc->after_count == MAX_AFTER){
+            printf("usage: submit --after <pid>[,<pid>...] <job> [priority], at most %d pids of jobs of this shell\n", MAX_AFTER);
+            return -1;
+        }
+        proc->after[proc->after_count++] = parent->seq;
+        parent->dependents++;
+        if (*next == ','){
+            next++;
+        }
+    }
+    if (proc->after_count == 0){
+        printf("usage: submit --after <pid>[,<pid>...] <job> [priority], at most %d pids of jobs of this shell\n", MAX_AFTER);
+        return -1;
+    }
+    return 0;
+}
+
+//newest entry of the table with a pid, NULL if the pid is not one of this shell's commands
+//the pid may be the last stage or an earlier stage of a pipeline, they all lead to the pipeline's entry
+//the pid index is probed linearly from the bucket of the pid, it stays at most half full so this takes constant time
+struct Process *find_job(int pid){
+    if (pid <= 0){
+        return NULL;
+    }
+    for (unsigned int b = (unsigned int) pid * 2654435761u % PID_BUCKETS; process_table->pid_index[b] != 0; b = (b+1) % PID_BUCKETS){
+        if (index_pid(process_table->pid_index[b]) == pid){
+            return &process_table->history[(process_table->pid_index[b] - 1) / (MAX_STAGES+1)];
+        }
+    }
+    return NULL;
+}
+
+//pid a pid index entry stands for, the last stage or one of the earlier stages of its command
+int index_pid(int entry){
+    struct Process *proc = &process_table->history[(entry - 1) / (MAX_STAGES+1)];
+    int stage = (entry - 1) % (MAX_STAGES+1);
+    return stage == 0 ? proc->pid : proc->stage_pids[stage-1];
+}
+
+//adds every pid of a command to the pid index, replacing an older command whose pid the kernel has reused
+void pid_index_insert(struct Process *proc){
+    if (proc->pid <= 0){
+        return;
+    }
+    int slot = proc - process_table->history;
+    for (int stage=0; stage<=proc->stage_count; stage++){
+        int pid = stage == 0 ? proc->pid : proc->stage_pids[stage-1];
+        unsigned int b = (unsigned int) pid * 2654435761u % PID_BUCKETS;
+        while (process_table->pid_index[b] != 0 && index_pid(process_table->pid_index[b]) != pid){
+            b = (b+1) % PID_BUCKETS;
+        }
+        process_table->pid_index[b] = INDEX_ENTRY(slot, stage);
+    }
+}
+
+//drops the pids of a command from the pid index before its slot is reused
+//the entries after one in the probe sequence are moved back into the hole, so lookups never need tombstones
+void pid_index_remove(struct Process *proc){
+    if (proc->pid <= 0){
+        return;
+    }
+    int slot = proc - process_table->history;
+    for (int stage=0; stage<=proc->stage_count; stage++){
+        int entry = INDEX_ENTRY(slot, stage);
+        unsigned int hole = (unsigned int) index_pid(entry) * 2654435761u % PID_BUCKETS;
+        while (process_table->pid_index[hole] != entry && process_table->pid_index[hole] != 0){
+            hole = (hole+1) % PID_BUCKETS;
+        }
+        if (process_table->pid_index[hole] == 0){
+            continue; //a newer command with the same pid took over the bucket
+        }
+        for (unsigned int b = (hole+1) % PID_BUCKETS; process_table->pid_index[b] != 0; b = (b+1) % PID_BUCKETS){
+            unsigned int home = (unsigned int) index_pid(process_table->pid_index[b]) * 2654435761u % PID_BUCKETS;
+            //an entry may move to the hole only if the hole lies between its home bucket and its bucket
+            if ((b - home) % PID_BUCKETS >= (b - hole) % PID_BUCKETS){
+                process_table->pid_index[hole] = process_table->pid_index[b];
+                hole = b;
+            }
+        }
+        process_table->pid_index[hole] = 0;
+    }
+}
+
+//frees the slot for the command with sequence number seq, called with the table locked
+//the command which had the slot MAX_HISTORY commands ago keeps it while it runs or the scheduler still holds it,
+//jobs still waiting for it are killed first if it failed, as they could no longer see how it exited
+bool recycle_slot(int seq){
+    struct Process *old = &process_table->history[SLOT(seq)];
+    if (seq < MAX_HISTORY){
+        return true;
+    }
+    if (old->pid > 0 && (!old->completed || old->queue)){
+        return false;
+    }
+    if (old->dependents > 0 && old->pid > 0 && (!WIFEXITED(old->exit_status) || WEXITSTATUS(old->exit_status) != 0)){
+        for (int i=seq-MAX_HISTORY+1; i<seq; i++){
+            struct Process *proc = &process_table->history[SLOT(i)];
+            for (int k=0; k<proc->after_count && proc->submit && !proc->completed && !proc->queue && !proc->released; k++){
+                if (proc->after[k] == old->seq){
+                    proc->released = true;
+                    proc->cancelled = true;
+                    kill(proc->pid, SIGKILL);
+                }
+            }
+        }
+    }
+    pid_index_remove(old);
+    return true;
+}
+
+//true for the builtins which never start a process or touch the slot of the command, called with the table locked
+//kill of a pid which is not a job of this shell runs the kill program, so it needs a slot
+bool slotless_command(char *command){
+    static char *builtins[] = {"exit", "jobs", "history", "pipesize", "managed", "spool", "cat-job", "tail-job", "report", "renice", "fg", "bg"};
+    char *name = command + strspn(command, " \t");
+    size_t length = strcspn(name, " ");
+    char *rest = name + length + strspn(name + length, " \t");
+    if (length == 4 && strncmp(name, "kill", 4) == 0){
+        char *end;
+        struct Process *proc = find_job((int) strtol(rest, &end, 10));
+        return end != rest && end[strspn(end, " \t")] == '\0' && proc != NULL && !proc->completed;
+    }
+    for (size_t i=0; i<sizeof(builtins)/sizeof(builtins[0]); i++){
+        if (strlen(builtins[i]) == length && strncmp(name, builtins[i], length) == 0){
+            //exit and jobs take no arguments, with arguments they are run as programs
+            return *rest == '\0' || (strcmp(builtins[i], "exit") != 0 && strcmp(builtins[i], "jobs") != 0);
+        }
+    }
+    return false;
+}
+
+//job control builtins for the jobs of this shell, returns false if the command is not one of them
+//renice <pid> <nice> : changes the weight of a submitted job, also while it is queued or running
+//kill <pid>          : terminates a job, a job stopped by the scheduler is continued so that it can exit
+//fg <pid>            : takes a job out of the scheduler and waits for it like a foreground command
+//bg <pid>            : takes a job out of the scheduler and lets it run in the background
+bool job_control(char *command){
+    char name[8];
+    int pid, nice = 0;
+    int fields = sscanf(command, "%7s %d %d", name, &pid, &nice);
+    bool renice = strcmp(name, "renice") == 0, kill_job = strcmp(name, "kill") == 0;
+    bool fg = strcmp(name, "fg") == 0, bg = strcmp(name, "bg") == 0;
+    if (fields < 1 || !(renice || kill_job || fg || bg)){
+        return false;
+    }
+    if (fields != (renice ? 3 : 2)){
+        if (kill_job){
+            return false;
+        }
+        printf("usage: renice <pid> <nice>, kill <pid>, fg <pid> or bg <pid>\n");
+        return true;
+    }
+    if (lock_table() == -1){
+        perror("pthread_mutex_lock");
         exit(1);
     }
-    else if (status == 0){
-        //exec to execute command (actual part of child process)
-        if (execvp(arguments[0],arguments) == -1) {
-            perror("execvp");
-            printf("Not a valid/supported command.\n");
-            exit(1);
+    struct Process *proc = find_job(pid);
+    bool handled = true;
+    if (proc == NULL || proc->completed){
+        handled = !kill_job;
+        if (handled){
+            printf("no running job with pid %d\n", pid);
         }
-        exit(0);
+        proc = NULL;
     }
-    else{
-        //parent process returns pid and stops child
-        if (kill(status, SIGSTOP) == -1){
+    else if (kill_job){
+        if ((signal_stages(proc, SIGTERM) == -1 || signal_stages(proc, SIGCONT) == -1) && errno != ESRCH){
             perror("kill");
-            exit(1);
         }
-        return status;
     }
+    else if (renice){
+        if (nice < -NICE_LEVELS/2 || nice >= NICE_LEVELS/2){
+            printf("nice is from %d to %d\n", -NICE_LEVELS/2, NICE_LEVELS/2 - 1);
+        }
+        else if (!proc->submit || proc->released){
+            printf("%d is not run by the scheduler\n", pid);
+        }
+        else if (request_job(REQUEST_RENICE, proc, nice)){
+            struct Process reniced = *proc;
+            reniced.nice = nice;
+            log_update(&reniced);
+        }
+    }
+    else if (proc->submit && !proc->released){
+        //the job is continued right away, the scheduler takes it out of its queues at its next check
+        if (request_job(REQUEST_RELEASE, proc, 0)){
+            proc->released = true;
+            signal_stages(proc, SIGCONT);
+        }
+        else{
+            fg = false;
+        }
+    }
+    else if (bg){
+        printf("%d already runs in the background\n", pid);
+    }
+    if (unlock_table() == -1){
+        perror("pthread_mutex_unlock");
+        exit(1);
+    }
+    if (fg && proc != NULL){
+        wait_job(proc);
+    }
+    return handled;
+}
+
+//sends a signal to every process of a command, the earlier stages of a pipeline first as the scheduler does,
+//so no stage is left stopped by the scheduler, returns -1 if the last stage could not be signalled
+int signal_stages(struct Process *proc, int sig){
+    for (int s=0; s<proc->stage_count; s++){
+        kill(proc->stage_pids[s], sig);
+    }
+    return kill(proc->pid, sig);
+}
+
+//waits for a job to be reaped like a foreground command, other children exiting meanwhile are recorded too
+void wait_job(struct Process *proc){
+    while (true){
+        reap_children();
+        if (lock_table() == -1){
+            perror("pthread_mutex_lock");
+            exit(1);
+        }
+        bool completed = proc->completed;
+        if (unlock_table() == -1){
+            perror("pthread_mutex_unlock");
+            exit(1);
+        }
+        if (completed){
+            return;
+        }
+        wait_sigchld();
+    }
+}
+
+//queues a request for the scheduler, called with the table locked
+bool request_job(int type, struct Process *proc, int nice){
+    if (process_table->request_count == MAX_REQUESTS){
+        printf("the scheduler has not caught up with earlier requests, try again\n");
+        return false;
+    }
+    struct request *request = &process_table->requests[process_table->request_count++];
+    request->type = type;
+    request->slot = proc - process_table->history;
+    request->nice = nice;
+    return true;
+}
+
+//forks a job and stops it before it gets any cpu time, the scheduler resumes it later
+int spawn_job(char **arguments){
+    int status = fork();
+    if (status < 0){
+        printf("fork() failed.\n");
+        exit(1);
+    }
+    else if (status == 0){
+        if (sigprocmask(SIG_SETMASK, &child_mask, NULL) == -1){
+            perror("sigprocmask");
+            exit(1);
+        }
+        //a spooled job writes stdout and stderr to its own file instead of the terminal
+        if (spool_mode != SPOOL_OFF){
+            char path[sizeof(spool_dir)+16];
+            spool_path(getpid(), path, sizeof(path));
+            int fd = open(path, O_CREAT|O_WRONLY|O_TRUNC, 0600);
+            if (fd == -1 || dup2(fd, STDOUT_FILENO) == -1 || dup2(fd, STDERR_FILENO) == -1){
+                perror("spool");
+                exit(1);
+            }
+            close(fd);
+        }
+        //exec to execute command (actual part of child process)
+        if (execvp(arguments[0],arguments) == -1) {
+            perror("execvp");
+            printf("Not a valid/supported command.\n");
+            exit(1);
+        }
+        exit(0);
+    }
+    else{
+        //parent process returns pid and stops child
+        if (kill(status, SIGSTOP) == -1){
+            perror("kill");
+            exit(1);
+        }
+        return status;
+    }
+}
+
+//spool [off|on|stream] : prints or sets where submitted jobs write stdout and stderr
+//cat-job <pid>          : prints the spooled output of a job, as far as it has got
+//tail-job <pid> [lines] : prints the last lines of the spooled output of a job
+int spool_command(char *command){
+    int pid, lines = TAIL_LINES;
+    if (strncmp(command, "cat-job ", 8) == 0){
+        if (sscanf(command + 8, "%d", &pid) != 1){
+            printf("usage: cat-job <pid>\n");
+            return 1;
+        }
+        spool_output(pid, 0);
+        return 1;
+    }
+    if (strncmp(command, "tail-job ", 9) == 0){
+        if (sscanf(command + 9, "%d %d", &pid, &lines) < 1 || lines < 1){
+            printf("usage: tail-job <pid> [lines]\n");
+            return 1;
+        }
+        spool_output(pid, lines);
+        return 1;
+    }
+    if (command[5] != '\0'){
+        char *mode = command + 6;
+        if (strcmp(mode, "off") == 0){
+            spool_mode = SPOOL_OFF;
+        }
+        else if (strcmp(mode, "on") == 0 || strcmp(mode, "stream") == 0){
+            //mkdtemp picks a name nobody else has created, so an existing directory or link is never used
+            if (spool_dir[0] == '\0'){
+                snprintf(spool_dir, sizeof(spool_dir), "%s.XXXXXX", SPOOL_DIR);
+                if (mkdtemp(spool_dir) == NULL){
+                    perror("mkdtemp");
+                    spool_dir[0] = '\0';
+                    return 1;
+                }
+            }
+            //only jobs submitted from now on are streamed
+            if (spool_mode == SPOOL_OFF){
+                stream_next = process_table->history_count;
+            }
+            spool_mode = strcmp(mode, "on") == 0 ? SPOOL_ON : SPOOL_STREAM;
+        }
+        else{
+            printf("usage: spool [off|on|stream]\n");
+            return 1;
+        }
+    }
+    char *modes[3] = {"off", "on, read with cat-job and tail-job", "on, finished output is printed in order"};
+    printf("spooling of job output is %s\n", modes[spool_mode]);
+    return 1;
+}
+
+void spool_path(int pid, char *path, size_t size){
+    snprintf(path, size, "%s/%d", spool_dir, pid);
+}
+
+//writes the spool file of a job from a read-only mapping, only the last lines if lines is not 0
+void spool_output(int pid, int lines){
+    char path[sizeof(spool_dir)+16];
+    spool_path(pid, path, sizeof(path));
+    int fd = spool_dir[0] != '\0' ? open(path, O_RDONLY) : -1;
+    if (fd == -1){
+        printf("no spooled output for %d\n", pid);
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1){
+        perror("fstat");
+        close(fd);
+        return;
+    }
+    if (st.st_size == 0){
+        close(fd);
+        return;
+    }
+    char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED){
+        perror("mmap");
+        return;
+    }
+    //walking back from the end (ignoring a final newline) until lines newlines have been passed
+    size_t start = 0;
+    if (lines > 0){
+        start = data[st.st_size-1] == '\n' ? st.st_size-1 : st.st_size;
+        while (start > 0 && !(data[start-1] == '\n' && --lines == 0)){
+            start--;
+        }
+    }
+    fflush(stdout);
+    for (size_t done=start; done<(size_t) st.st_size; ){
+        ssize_t n = write(STDOUT_FILENO, data + done, st.st_size - done);
+        if (n == -1){
+            if (errno == EINTR){
+                continue;
+            }
+            perror("write");
+            break;
+        }
+        done += n;
+    }
+    //output without a final newline (printed without one by the job) does not run into the prompt
+    if (data[st.st_size-1] != '\n'){
+        printf("\n");
+    }
+    munmap(data, st.st_size);
+}
+
+//prints the output of spooled jobs which have finished and have no unfinished spooled job before them
+//returns the number of jobs printed
+int stream_spool(){
+    int printed = 0;
+    while (spool_mode == SPOOL_STREAM){
+        int pid = -1;
+        char command[MAX_SIZE+1];
+        if (lock_table() == -1){
+            perror("pthread_mutex_lock");
+            exit(1);
+        }
+        if (stream_next < process_table->history_count - MAX_HISTORY){
+            stream_next = process_table->history_count - MAX_HISTORY;
+        }
+        for (; stream_next<process_table->history_count && pid == -1; stream_next++){
+            struct Process *proc = &process_table->history[SLOT(stream_next)];
+            if (proc->seq != stream_next || !proc->spooled){
+                continue;
+            }
+            if (!proc->completed){
+                break;
+            }
+            pid = proc->pid;
+            strcpy(command, proc->command);
+        }
+        if (unlock_table() == -1){
+            perror("pthread_mutex_unlock");
+            exit(1);
+        }
+        if (pid == -1){
+            break;
+        }
+        printf("%s==> %d %s <==\n", printed == 0 ? "\n" : "", pid, command);
+        spool_output(pid, 0);
+        printed++;
+    }
+    return printed;
+}
+
+//removes this shell's spool directory and the output in it
+void spool_cleanup(){
+    if (spool_dir[0] == '\0'){
+        return;
+    }
+    DIR *dir = opendir(spool_dir);
+    if (dir == NULL){
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL){
+        if (entry->d_name[0] != '.'){
+            unlinkat(dirfd(dir), entry->d_name, 0);
+        }
+    }
+    closedir(dir);
+    rmdir(spool_dir);
+}
+
+//bulk submit, creates many jobs with one command and publishes them to the scheduler together
+//submit -n <count> <job> [priority] : count copies of job, {} in job is replaced by the copy index
+//submit -f <manifest>               : one job per line of manifest as "<job> [priority]", # starts a comment
+int submit_batch(char *command){
+    static char jobs[MAX_BATCH][MAX_SIZE+1];
+    int job_count = 0;
+
+    if (command[8] == 'n'){
+        char *job = command + 10;
+        int count = (int) strtol(job, &job, 10);
+        while (*job == ' '){
+            job++;
+        }
+        if (count < 1 || count > MAX_BATCH || *job == '\0'){
+            printf("usage: submit -n <count> <job> [priority], count is at most %d\n", MAX_BATCH);
+            return 1;
+        }
+        for (job_count=0; job_count<count; job_count++){
+            //copying job into its slot while expanding {} to the copy index
+            char *src = job, *dst = jobs[job_count], *last = jobs[job_count] + MAX_SIZE;
+            while (*src != '\0' && dst < last){
+                if (src[0] == '{' && src[1] == '}'){
+                    dst += snprintf(dst, last-dst+1, "%d", job_count);
+                    if (dst > last){
+                        dst = last;
+                    }
+                    src += 2;
+                }
+                else{
+                    *dst++ = *src++;
+                }
+            }
+            *dst = '\0';
+        }
+    }
+    else{
+        FILE *manifest = fopen(command + 10, "r");
+        if (manifest == NULL){
+            perror("fopen");
+            return 1;
+        }
+        char line[MAX_SIZE+2];
+        while (job_count < MAX_BATCH && fgets(line, sizeof(line), manifest) != NULL){
+            line[strcspn(line, "\n")] = '\0';
+            char *job = line + strspn(line, " \t");
+            if (*job == '\0' || *job == '#'){
+                continue;
+            }
+            strcpy(jobs[job_count++], job);
+        }
+        if (!feof(manifest)){
+            printf("manifest has more than %d jobs, only the first %d are submitted\n", MAX_BATCH, MAX_BATCH);
+        }
+        fclose(manifest);
+        if (job_count == 0){
+            printf("no jobs in manifest\n");
+            return 1;
+        }
+    }
+
+    if (lock_table() == -1){
+        perror("pthread_mutex_lock");
+        exit(1);
+    }
+    //the first job takes the slot of the command itself, shell_loop has freed it already
+    int base = process_table->history_count;
+    for (int j=1; j<job_count; j++){
+        if (!recycle_slot(base+j)){
+            printf("some of the last %d commands are still running, batch of %d jobs not submitted\n", MAX_HISTORY, job_count);
+            job_count = 0;
+        }
+    }
+    //the oldest commands the scheduler still scans share these slots, marking them completed makes it pass over them,
+    //so the jobs are forked and filled in without holding the lock
+    for (int j=0; j<job_count; j++){
+        process_table->history[SLOT(base+j)].completed = true;
+        process_table->history[SLOT(base+j)].queue = false;
+    }
+    batch_hidden = job_count > 0;
+    if (unlock_table() == -1){
+        perror("pthread_mutex_unlock");
+        exit(1);
+    }
+    for (int j=0; j<job_count; j++){
+        struct Process *proc = &process_table->history[SLOT(base+j)];
+        char* arguments[MAX_WORDS+1]; //+1 to accomodate NULL
+        strcpy(proc->command, jobs[j]);
+        proc->seq = base+j;
+        proc->dependents = 0;
+        proc->submit = true;
+        proc->released = false;
+        proc->cancelled = false;
+        proc->interactive = false;
+        proc->stage_count = 0;
+        proc->unreaped = 0;
+        proc->spooled = false;
+        proc->wait_time = proc->execution_time = proc->vruntime = 0;
+        proc->exit_status = 0;
+        proc->rss_kb = 0;
+        proc->hint_ms = command_hint(jobs[j]);
+        memset(&proc->usage, 0, sizeof(struct rusage));
+        if (parse_job(jobs[j], arguments, proc) < 0){
+            printf("invalid priority or dependency for job %d: %s\n", j, proc->command);
+            proc->pid = -1;
+        }
+        else{
+            proc->spooled = spool_mode != SPOOL_OFF;
+            proc->pid = spawn_job(arguments);
+        }
+        start_time(&proc->start);
+    }
+    //shell_loop publishes all the slots to the scheduler in a single history_count update
+    if (job_count > 0){
+        batch_slots = job_count;
+    }
+    return 1;
+}
+
+//resizes a pipe to the configured pipe_size, the pipe keeps its old size if the kernel refuses
+int set_pipe_size(int fd){
+    if (pipe_size <= 0){
+        return 0;
+    }
+    if (fcntl(fd, F_SETPIPE_SZ, pipe_size) == -1){
+        perror("fcntl");
+        return -1;
+    }
+    return 0;
+}
+
+//moves everything from in_fd to out_fd until EOF without copying it through user space
+//splice needs a pipe on one side, so it falls back to a read/write loop when neither fd is a pipe
+long splice_all(int in_fd, int out_fd){
+    long total = 0;
+    ssize_t n;
+    while ((n = splice(in_fd, NULL, out_fd, NULL, SPLICE_CHUNK, SPLICE_F_MOVE|SPLICE_F_MORE)) > 0){
+        total += n;
+    }
+    if (n == 0){
+        return total;
+    }
+    if (errno != EINVAL){
+        perror("splice");
+        return -1;
+    }
+    static char buffer[1<<16];
+    while ((n = read(in_fd, buffer, sizeof(buffer))) > 0){
+        for (ssize_t done = 0, w; done < n; done += w){
+            if ((w = write(out_fd, buffer + done, n - done)) == -1){
+                perror("write");
+                return -1;
+            }
+        }
+        total += n;
+    }
+    if (n == -1){
+        perror("read");
+        return -1;
+    }
+    return total;
+}
+
+//pipeline builtins for plumbing that would otherwise copy every byte through a process
+//scat [file...]        : stdin (or the files in order) to stdout
+//sto [-a] <file>       : stdin to file, truncating it or appending with -a
+//stee [-a] <file...>   : stdin to stdout and to every file
+//returns the exit status for the child or -1 if the command is not a splice builtin
+int splice_builtin(char **arguments){
+    int flags = O_WRONLY|O_CREAT|O_TRUNC;
+    if (strcmp(arguments[0], "scat") == 0){
+        if (arguments[1] == NULL){
+            return splice_all(STDIN_FILENO, STDOUT_FILENO) == -1;
+        }
+        for (int i=1; arguments[i] != NULL; i++){
+            int fd = open(arguments[i], O_RDONLY);
+            if (fd == -1){
+                perror("open");
+                return 1;
+            }
+            long ret = splice_all(fd, STDOUT_FILENO);
+            close(fd);
+            if (ret == -1){
+                return 1;
+            }
+        }
+        return 0;
+    }
+    if (strcmp(arguments[0], "sto") != 0 && strcmp(arguments[0], "stee") != 0){
+        return -1;
+    }
+
+    int first = 1;
+    if (arguments[1] != NULL && strcmp(arguments[1], "-a") == 0){
+        flags = O_WRONLY|O_CREAT|O_APPEND;
+        first = 2;
+    }
+    int file_fds[MAX_WORDS], file_count = 0;
+    for (int i=first; arguments[i] != NULL; i++){
+        if ((file_fds[file_count] = open(arguments[i], flags, 0666)) == -1){
+            perror("open");
+            return 1;
+        }
+        file_count++;
+    }
+    if (file_count == 0){
+        printf("usage: %s [-a] <file>\n", arguments[0]);
+        return 1;
+    }
+    if (strcmp(arguments[0], "sto") == 0){
+        return splice_all(STDIN_FILENO, file_fds[0]) == -1;
+    }
+
+    //stee: tee duplicates the pipe contents without consuming them, once for every consumer but the last,
+    //the last consumer then splices the same bytes out of stdin which also consumes them
+    //a scratch pipe is needed in between because tee can only write into pipes
+    int scratch[2];
+    if (pipe(scratch) == -1){
+        perror("pipe");
+        return 1;
+    }
+    int in_size = fcntl(STDIN_FILENO, F_GETPIPE_SZ);
+    if (in_size == -1){
+        //stdin is not a pipe so there is nothing to tee from, copy through user space instead
+        static char buffer[1<<16];
+        ssize_t n;
+        while ((n = read(STDIN_FILENO, buffer, sizeof(buffer))) > 0){
+            for (int i=-1; i<file_count; i++){
+                int fd = i == -1 ? STDOUT_FILENO : file_fds[i];
+                for (ssize_t done = 0, w; done < n; done += w){
+                    if ((w = write(fd, buffer + done, n - done)) == -1){
+                        perror("write");
+                        return 1;
+                    }
+                }
+            }
+        }
+        return n == -1;
+    }
+    if (fcntl(scratch[1], F_SETPIPE_SZ, in_size) == -1){
+        perror("fcntl");
+        return 1;
+    }
+    while (true){
+        //the number of bytes handled this round is whatever the first tee manages to duplicate
+        ssize_t n = tee(STDIN_FILENO, scratch[1], in_size, 0);
+        if (n == 0){
+            return 0;
+        }
+        if (n == -1){
+            perror("tee");
+            return 1;
+        }
+        for (int i=-1; i<file_count-1; i++){
+            int fd = i == -1 ? STDOUT_FILENO : file_fds[i];
+            if (i >= 0 && tee(STDIN_FILENO, scratch[1], n, 0) != n){
+                perror("tee");
+                return 1;
+            }
+            if (splice_n(scratch[0], fd, n) == -1){
+                return 1;
+            }
+        }
+        if (splice_n(STDIN_FILENO, file_fds[file_count-1], n) == -1){
+            return 1;
+        }
+    }
+}
+
+//moves exactly n bytes out of the pipe in_fd, through user space only if out_fd does not support splice
+int splice_n(int in_fd, int out_fd, ssize_t n){
+    static char buffer[1<<16];
+    while (n > 0){
+        ssize_t w = splice(in_fd, NULL, out_fd, NULL, n, SPLICE_F_MOVE);
+        if (w == -1 && errno == EINVAL){
+            w = read(in_fd, buffer, n < (ssize_t) sizeof(buffer) ? n : (ssize_t) sizeof(buffer));
+            for (ssize_t done = 0, d; w > 0 && done < w; done += d){
+                if ((d = write(out_fd, buffer + done, w - done)) == -1){
+                    perror("write");
+                    return -1;
+                }
+            }
+        }
+        if (w <= 0){
+            perror("splice");
+            return -1;
+        }
+        n -= w;
+    }
+    return 0;
+}
+
+//parallel <job...> ::: <input...>  or  parallel -a <file> <job...>
+//runs job once per input ({} in job is replaced by the input, otherwise it is appended) with ncpu jobs in flight,
+//a new job is started whenever one exits and the output of each job is printed whole and in input order
+//the jobs are not run by the scheduler, also with managed on, they take ncpu cpus next to its jobs while it runs
+int parallel(char *command){
+    char *job[MAX_WORDS+1], *inputs[MAX_WORDS];
+    int job_words = 0, input_count = 0, next_input = 0;
+    FILE *input_file = NULL;
+    char *token = strtok(command, " "); //remove parallel keyword from command
+    token = strtok(NULL, " ");
+    if (token != NULL && strcmp(token, "-a") == 0){
+        token = strtok(NULL, " ");
+        if (token == NULL || (input_file = fopen(token, "r")) == NULL){
+            if (token != NULL){
+                perror("fopen");
+            }
+            printf("usage: parallel -a <file> <job...>\n");
+            return 1;
+        }
+        token = strtok(NULL, " ");
+    }
+    bool too_many = false;
+    for (; token != NULL && strcmp(token, ":::") != 0; token = strtok(NULL, " ")){
+        if (job_words == MAX_WORDS-1){
+            too_many = true;
+            break;
+        }
+        job[job_words++] = token;
+    }
+    if (token != NULL && !too_many){
+        while ((token = strtok(NULL, " ")) != NULL){
+            if (input_count == MAX_WORDS){
+                too_many = true;
+                break;
+            }
+            inputs[input_count++] = token;
+        }
+    }
+    //every line of the input file has to fit in a line buffer, checked before any job is started
+    bool too_long = false;
+    if (input_file != NULL){
+        char line[MAX_SIZE+2];
+        while (!too_long && fgets(line, sizeof(line), input_file) != NULL){
+            too_long = strchr(line, '\n') == NULL && !feof(input_file);
+        }
+        rewind(input_file);
+    }
+    if (job_words == 0 || (input_file == NULL && input_count == 0) || too_many || too_long){
+        printf("usage: parallel <job...> ::: <input...> or parallel -a <file> <job...>\n");
+        printf("at most %d job words and %d inputs, input lines of at most %d characters\n", MAX_WORDS-1, MAX_WORDS, MAX_SIZE);
+        if (input_file != NULL){
+            fclose(input_file);
+        }
+        return 1;
+    }
+
+    int ncpu = process_table->ncpu;
+    int launched = 0, printed = 0, running = 0, failed = 0, capacity = 0;
+    bool more = true;
+    struct parallel_job *jobs = NULL;
+    struct timeval start;
+    start_time(&start);
+    fflush(stdout);
+    while (more || running > 0){
+        //filling every free cpu, as long as the output window of unprinted jobs is not full
+        while (more && running < ncpu && launched - printed < MAX_PARALLEL_WINDOW){
+            char line[MAX_SIZE+2], *input;
+            if (input_file != NULL){
+                if (fgets(line, sizeof(line), input_file) == NULL){
+                    more = false;
+                    break;
+                }
+                line[strcspn(line, "\n")] = '\0';
+                input = line;
+            }
+            else if (next_input < input_count){
+                input = inputs[next_input++];
+            }
+            else{
+                more = false;
+                break;
+            }
+            if (launched == capacity){
+                capacity = capacity ? capacity*2 : 64;
+                jobs = realloc(jobs, capacity * sizeof(struct parallel_job));
+                if (jobs == NULL){
+                    perror("realloc");
+                    exit(1);
+                }
+            }
+            struct parallel_job *pjob = &jobs[launched];
+            pjob->done = false;
+            //close-on-exec so jobs do not inherit the buffers of the others, dup2 clears it on stdout and stderr
+            pjob->out_fd = memfd_create("parallel", MFD_CLOEXEC);
+            if (pjob->out_fd == -1){
+                perror("memfd_create");
+                exit(1);
+            }
+            start_time(&pjob->start);
+            pjob->pid = fork();
+            if (pjob->pid < 0){
+                printf("fork() failed.\n");
+                exit(1);
+            }
+            if (pjob->pid == 0){
+                if (sigprocmask(SIG_SETMASK, &child_mask, NULL) == -1){
+                    perror("sigprocmask");
+                    exit(1);
+                }
+                //job output goes to its own buffer so that it is not interleaved with other jobs
+                if (dup2(pjob->out_fd, STDOUT_FILENO) == -1 || dup2(pjob->out_fd, STDERR_FILENO) == -1){
+                    perror("dup2");
+                    exit(1);
+                }
+                char* arguments[MAX_WORDS+2]; //+2 to accomodate the input and NULL
+                char expanded[MAX_WORDS][2*MAX_SIZE+1]; //a job word with the input in place of {}
+                bool substituted = false;
+                int argument_count = 0;
+                for (int i=0; i<job_words; i++){
+                    char *brace = strstr(job[i], "{}");
+                    if (brace != NULL){
+                        snprintf(expanded[i], sizeof(expanded[i]), "%.*s%s%s", (int)(brace - job[i]), job[i], input, brace+2);
+                        arguments[argument_count++] = expanded[i];
+                        substituted = true;
+                    }
+                    else{
+                        arguments[argument_count++] = job[i];
+                    }
+                }
+                if (!substituted){
+                    arguments[argument_count++] = input;
+                }
+                arguments[argument_count] = NULL;
+                if (execvp(arguments[0],arguments) == -1) {
+                    perror("execvp");
+                    exit(127);
+                }
+            }
+            launched++;
+            running++;
+        }
+        if (running == 0){
+            break;
+        }
+
+        //blocking until a child exits, exits of other jobs are recorded in the history table
+        wait_sigchld();
+        int ret, pid;
+        struct rusage usage;
+        while ((pid = wait4(-1, &ret, WNOHANG, &usage)) > 0){
+            int i;
+            for (i=printed; i<launched && jobs[i].pid != pid; i++);
+            if (i == launched){
+                record_exit(pid, ret, &usage);
+                continue;
+            }
+            jobs[i].done = true;
+            jobs[i].run_time = end_time(&jobs[i].start);
+            jobs[i].status = WIFEXITED(ret) ? WEXITSTATUS(ret) : 128 + WTERMSIG(ret);
+            if (jobs[i].status != 0){
+                failed++;
+            }
+            running--;
+        }
+        //printing the output of every finished job which has no unfinished job before it
+        for (; printed<launched && jobs[printed].done; printed++){
+            if (lseek(jobs[printed].out_fd, 0, SEEK_SET) == -1 || splice_all(jobs[printed].out_fd, STDOUT_FILENO) == -1){
+                perror("parallel output");
+            }
+            close(jobs[printed].out_fd);
+        }
+    }
+    unsigned long total_time = end_time(&start);
+    if (input_file != NULL){
+        fclose(input_file);
+    }
+
+    //per job timing followed by throughput of the whole run
+    printf("\nJob\t\tPID\t\tStatus\t\tExecution_time\n");
+    for (int i=0; i<launched; i++){
+        printf("%d\t\t%d\t\t%d\t\t%ldms\n", i, jobs[i].pid, jobs[i].status, jobs[i].run_time);
+    }
+    printf("%d jobs (%d failed) on %d cpus in %ldms, %.2f jobs/s\n", launched, failed, ncpu, total_time, total_time ? launched * 1000.0 / total_time : 0.0);
+    free(jobs);
+    return 1;
+}
+
+//report                     : prints statistics of the jobs completed so far
+//report csv|json <file>     : streams a record of every job completing from now on to file (json is one object per line)
+//report off                 : stops streaming records
+int report_command(char *command){
+    char *mode = strtok(command + 6, " ");
+    char *path = strtok(NULL, " ");
+    if (mode == NULL){
+        analytics_report();
+        return 1;
+    }
+    if (strcmp(mode, "off") != 0 && (path == NULL || (strcmp(mode, "csv") != 0 && strcmp(mode, "json") != 0))){
+        printf("usage: report [csv|json <file>|off]\n");
+        return 1;
+    }
+    if (record_file != NULL){
+        fclose(record_file);
+        record_file = NULL;
+    }
+    if (strcmp(mode, "off") == 0){
+        return 1;
+    }
+    record_file = fopen(path, "w");
+    if (record_file == NULL){
+        perror("fopen");
+        return 1;
+    }
+    record_json = strcmp(mode, "json") == 0;
+    if (!record_json){
+        fprintf(record_file, "pid,command,nice,exit_status,turnaround_ms,wait_ms,execution_ms,user_ms,system_ms,slowdown,max_rss_kb,context_switches\n");
+    }
+    return 1;
+}
+
+//adds a completed job to the running statistics and to the record file, constant time per job
+void report_job(struct Process *proc){
+    unsigned long user = proc->usage.ru_utime.tv_sec*1000 + proc->usage.ru_utime.tv_usec/1000;
+    unsigned long sys = proc->usage.ru_stime.tv_sec*1000 + proc->usage.ru_stime.tv_usec/1000;
+    unsigned long cpu = user + sys;
+    //submitted jobs alternate between waiting and running, others only run
+    unsigned long turnaround = proc->execution_time + (proc->submit ? proc->wait_time : 0);
+    unsigned long slowdown = turnaround > SLOWDOWN_BOUND ? turnaround * 100 / (cpu > SLOWDOWN_BOUND ? cpu : SLOWDOWN_BOUND) : 100;
+    if (slowdown < 100){
+        slowdown = 100;
+    }
+    unsigned long values[REPORT_METRICS] = {turnaround, proc->submit ? proc->wait_time : 0, cpu, slowdown};
+    double share = turnaround > 0 ? (double) cpu / turnaround : 1.0;
+
+    char name[MAX_SIZE+1];
+    command_name(proc->command, name);
+    struct report_group *command = NULL;
+    for (int i=0; i<report_command_count && command == NULL; i++){
+        if (strcmp(report_commands[i].name, name) == 0){
+            command = &report_commands[i];
+        }
+    }
+    if (command == NULL){
+        //once the table is full every new command is counted under the last group
+        if (report_command_count < MAX_REPORT_COMMANDS){
+            command = &report_commands[report_command_count++];
+            strcpy(command->name, report_command_count == MAX_REPORT_COMMANDS ? "(other)" : name);
+        }
+        else{
+            command = &report_commands[MAX_REPORT_COMMANDS-1];
+        }
+    }
+    //submitted jobs by their nice value, every other command in the last group
+    int nice = proc->submit && proc->nice >= -NICE_LEVELS/2 && proc->nice < NICE_LEVELS/2 ? proc->nice + NICE_LEVELS/2 : NICE_LEVELS;
+    struct report_group *groups[3] = {&report_total, &report_nice[nice], command};
+    for (int g=0; g<3; g++){
+        for (int m=0; m<REPORT_METRICS; m++){
+            sketch_add(&groups[g]->metrics[m], values[m]);
+        }
+        groups[g]->share_sum += share;
+        groups[g]->share_sq += share * share;
+    }
+    start_time(&last_completion);
+
+    if (record_file == NULL){
+        return;
+    }
+    if (record_json){
+        fprintf(record_file, "{\"pid\":%d,\"command\":\"", proc->pid);
+        write_escaped(record_file, proc->command, '\\');
+        fprintf(record_file, "\",\"nice\":%d,\"exit_status\":%d,\"turnaround_ms\":%lu,\"wait_ms\":%lu,\"execution_ms\":%lu,\"user_ms\":%lu,\"system_ms\":%lu,\"slowdown\":%.2f,\"max_rss_kb\":%ld,\"context_switches\":%ld}\n",
+            proc->nice, proc->exit_status, turnaround, values[1], proc->execution_time, user, sys, slowdown / 100.0, proc->usage.ru_maxrss, proc->usage.ru_nvcsw + proc->usage.ru_nivcsw);
+    }
+    else{
+        fprintf(record_file, "%d,\"", proc->pid);
+        write_escaped(record_file, proc->command, '"');
+        fprintf(record_file, "\",%d,%d,%lu,%lu,%lu,%lu,%lu,%.2f,%ld,%ld\n",
+            proc->nice, proc->exit_status, turnaround, values[1], proc->execution_time, user, sys, slowdown / 100.0, proc->usage.ru_maxrss, proc->usage.ru_nvcsw + proc->usage.ru_nivcsw);
+    }
+}
+
+//writes str inside a quoted field, a quote is escaped with the given character (\ for json, " for csv)
+void write_escaped(FILE *file, char *str, char quote){
+    for (; *str != '\0'; str++){
+        if (*str == '"' || (quote == '\\' && *str == '\\')){
+            fputc(quote, file);
+        }
+        fputc(*str, file);
+    }
+}
+
+//command name is the program run, without the submit keyword, its options and directories
+void command_name(char *command, char *name){
+    char *start = command;
+    if (strncmp(start, "submit ", 7) == 0){
+        start += 7;
+    }
+    start += strspn(start, " ");
+    //skipping every leading option and its value, the same options parse_job accepts
+    while (strncmp(start, "--after ", 8) == 0 || strncmp(start, "--nice ", 7) == 0){
+        start += strcspn(start, " ");
+        start += strspn(start, " ");
+        start += strcspn(start, " ");
+        start += strspn(start, " ");
+    }
+    size_t length = strcspn(start, " |&");
+    snprintf(name, MAX_SIZE+1, "%.*s", (int) length, start);
+    char *base = strrchr(name, '/');
+    if (base != NULL && base[1] != '\0'){
+        memmove(name, base+1, strlen(base));
+    }
+}
+
+//mean cpu time in ms of the completed jobs running the same command, the scheduler's runtime hint, 0 if unknown
+long command_hint(char *command){
+    char name[MAX_SIZE+1];
+    command_name(command, name);
+    for (int i=0; i<report_command_count; i++){
+        struct sketch *cpu = &report_commands[i].metrics[2];
+        if (strcmp(report_commands[i].name, name) == 0 && cpu->count > 0){
+            return (long)(cpu->sum / cpu->count);
+        }
+    }
+    return 0;
+}
+
+//values below 16 get a bucket each, above that a power of two is split into 16 buckets
+void sketch_add(struct sketch *sk, unsigned long value){
+    int bucket = value;
+    if (value >= 16){
+        int exponent = 63 - __builtin_clzl(value);
+        bucket = (exponent-3)*16 + ((value >> (exponent-4)) & 15);
+    }
+    if (bucket >= SKETCH_BUCKETS){
+        bucket = SKETCH_BUCKETS-1;
+    }
+    sk->buckets[bucket]++;
+    sk->count++;
+    sk->sum += value;
+}
+
+//value at quantile q, taken as the middle of the bucket holding it
+unsigned long sketch_quantile(struct sketch *sk, double q){
+    unsigned long rank = (unsigned long)(q * (sk->count-1)) + 1, seen = 0;
+    for (int bucket=0; bucket<SKETCH_BUCKETS; bucket++){
+        seen += sk->buckets[bucket];
+        if (seen >= rank){
+            if (bucket < 16){
+                return bucket;
+            }
+            int exponent = bucket/16 + 3;
+            unsigned long low = (16UL + bucket%16) << (exponent-4);
+            return low + (1UL << (exponent-4))/2;
+        }
+    }
+    return 0;
+}
+
+void print_group(struct report_group *group){
+    static char *metric_names[REPORT_METRICS] = {"turnaround", "wait", "cpu", "slowdown"};
+    unsigned long count = group->metrics[0].count;
+    if (count == 0){
+        return;
+    }
+    //jain's index is 1 when every job got the same share of its turnaround on a cpu and 1/n at worst
+    printf("%s\t\t%lu jobs\t\tfairness %.3f\n", group->name, count, group->share_sq > 0 ? group->share_sum * group->share_sum / (count * group->share_sq) : 1.0);
+    for (int m=0; m<REPORT_METRICS; m++){
+        struct sketch *sk = &group->metrics[m];
+        double scale = m == 3 ? 100.0 : 1.0;
+        char *unit = m == 3 ? "x" : "ms";
+        printf("\t%s\t\tmean %.2f%s\t\tp50 %.2f%s\t\tp95 %.2f%s\t\tp99 %.2f%s\n", metric_names[m], sk->sum / sk->count / scale, unit,
+            sketch_quantile(sk, 0.50) / scale, unit, sketch_quantile(sk, 0.95) / scale, unit, sketch_quantile(sk, 0.99) / scale, unit);
+    }
+}
+
+//statistics of completed jobs in total, per priority and per command, all kept up to date as jobs complete
+void analytics_report(){
+    unsigned long count = report_total.metrics[0].count;
+    if (count == 0){
+        return;
+    }
+    if (record_file != NULL){
+        fflush(record_file);
+    }
+    unsigned long elapsed = last_completion.tv_sec*1000 + last_completion.tv_usec/1000 - (session_start.tv_sec*1000 + session_start.tv_usec/1000);
+    printf("\n%lu jobs completed in %lums, throughput %.2f jobs/s\n", count, elapsed, elapsed ? count * 1000.0 / elapsed : 0.0);
+    strcpy(report_total.name, "all");
+    print_group(&report_total);
+    for (int i=0; i<NICE_LEVELS; i++){
+        snprintf(report_nice[i].name, sizeof(report_nice[i].name), "nice %d", i - NICE_LEVELS/2);
+        print_group(&report_nice[i]);
+    }
+    strcpy(report_nice[NICE_LEVELS].name, "not submitted");
+    print_group(&report_nice[NICE_LEVELS]);
+    for (int i=0; i<report_command_count; i++){
+        print_group(&report_commands[i]);
+    }
+}
+
+//maps the history log and its pid index, creating them if needed
+//only the index is rebuilt at startup and only if it does not cover every record (e.g. after a crash)
+void log_open(){
+    char path[4096];
+    char *home = getenv("HOME");
+    snprintf(path, sizeof(path), "%s/%s", home != NULL ? home : ".", LOG_NAME);
+    session_id = getpid();
+    log_fd = open(path, O_RDWR|O_CREAT|O_CLOEXEC, 0644);
+    strcat(path, ".idx");
+    index_fd = open(path, O_RDWR|O_CREAT|O_CLOEXEC, 0644);
+    if (log_fd == -1 || index_fd == -1){
+        perror("open");
+        exit(1);
+    }
+    if (flock(log_fd, LOCK_EX) == -1){
+        perror("flock");
+        exit(1);
+    }
+    struct stat st;
+    if (fstat(log_fd, &st) == -1){
+        perror("fstat");
+        exit(1);
+    }
+    if (st.st_size < (off_t) sizeof(struct log_header)){
+        log_map(log_fd, (void **) &log_map_header, &log_size, sizeof(struct log_header) + LOG_INITIAL_CAPACITY * sizeof(struct log_record));
+        log_map_header->magic = LOG_MAGIC;
+        log_map_header->record_size = sizeof(struct log_record);
+        log_map_header->count = 0;
+        log_map_header->capacity = LOG_INITIAL_CAPACITY;
+    }
+    else{
+        log_map(log_fd, (void **) &log_map_header, &log_size, st.st_size);
+        if (log_map_header->magic != LOG_MAGIC || log_map_header->record_size != sizeof(struct log_record)){
+            printf("%s is not a history log of this shell\n", path);
+            exit(1);
+        }
+    }
+    if (fstat(index_fd, &st) == -1){
+        perror("fstat");
+        exit(1);
+    }
+    if (st.st_size >= (off_t) sizeof(struct index_header)){
+        log_map(index_fd, (void **) &index_map_header, &index_size, st.st_size);
+    }
+    if (index_size == 0 || index_map_header->count != log_map_header->count){
+        index_rebuild(LOG_INITIAL_CAPACITY);
+    }
+    log_session_first = log_map_header->count;
+    if (flock(log_fd, LOCK_UN) == -1){
+        perror("flock");
+        exit(1);
+    }
+}
+
+void log_close(){
+    if (log_fd == -1){
+        return;
+    }
+    munmap(log_map_header, log_size);
+    munmap(index_map_header, index_size);
+    close(log_fd);
+    close(index_fd);
+    log_fd = index_fd = -1;
+}
+
+//grows (or first maps) a file and its shared mapping to new_size bytes
+void log_map(int fd, void **map, size_t *size, size_t new_size){
+    struct stat st;
+    if (fstat(fd, &st) == -1){
+        perror("fstat");
+        exit(1);
+    }
+    if (st.st_size < (off_t) new_size && ftruncate(fd, new_size) == -1){
+        perror("ftruncate");
+        exit(1);
+    }
+    void *new_map = *size == 0 ? mmap(NULL, new_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0) : mremap(*map, *size, new_size, MREMAP_MAYMOVE);
+    if (new_map == MAP_FAILED){
+        perror("mmap");
+        exit(1);
+    }
+    *map = new_map;
+    *size = new_size;
+}
+
+//appends a record for the process and returns its number, the file is locked for shells sharing the log
+long log_append(struct Process *proc){
+    if (flock(log_fd, LOCK_EX) == -1){
+        perror("flock");
+        exit(1);
+    }
+    log_refresh();
+    if (log_map_header->count == log_map_header->capacity){
+        log_map(log_fd, (void **) &log_map_header, &log_size, sizeof(struct log_header) + 2 * log_map_header->capacity * sizeof(struct log_record));
+        log_map_header->capacity *= 2;
+    }
+    long index = log_map_header->count;
+    struct log_record *record = (struct log_record *)(log_map_header + 1) + index;
+    memset(record, 0, sizeof(struct log_record));
+    record->start_ms = now_ms();
+    record->session = session_id;
+    record->pid = proc->pid;
+    record->nice = proc->nice;
+    record->submit = proc->submit;
+    record->completed = proc->completed; //a submit that failed to parse never runs
+    strcpy(record->command, proc->command);
+    //the record is only visible once count covers it
+    log_map_header->count++;
+    index_insert(index);
+    if (flock(log_fd, LOCK_UN) == -1){
+        perror("flock");
+        exit(1);
+    }
+    return index;
+}
+
+//fills in what launch found out about a command whose record was appended when it was entered
+//the pid is indexed once it is known, so calling it again after the pid was recorded does not index it twice
+void log_launched(struct Process *proc){
+    if (proc->log_index < 0){
+        return;
+    }
+    if (flock(log_fd, LOCK_EX) == -1){
+        perror("flock");
+        exit(1);
+    }
+    log_refresh();
+    struct log_record *record = (struct log_record *)(log_map_header + 1) + proc->log_index;
+    bool new_pid = record->pid != proc->pid;
+    record->pid = proc->pid;
+    record->nice = proc->nice;
+    record->submit = proc->submit;
+    record->completed = proc->completed;
+    strcpy(record->command, proc->command);
+    if (new_pid){
+        index_insert(proc->log_index);
+    }
+    if (flock(log_fd, LOCK_UN) == -1){
+        perror("flock");
+        exit(1);
+    }
+}
+
+//another shell sharing the log may have grown it or its index since they were mapped here
+void log_refresh(){
+    size_t size = sizeof(struct log_header) + log_map_header->capacity * sizeof(struct log_record);
+    if (size > log_size){
+        log_map(log_fd, (void **) &log_map_header, &log_size, size);
+    }
+    size = sizeof(struct index_header) + index_map_header->buckets * sizeof(long);
+    if (size > index_size){
+        log_map(index_fd, (void **) &index_map_header, &index_size, size);
+    }
+}
+
+//writes the current state of the process into its record
+void log_update(struct Process *proc){
+    if (proc->log_index < 0 || proc->log_index >= log_map_header->count){
+        return;
+    }
+    struct log_record *record = (struct log_record *)(log_map_header + 1) + proc->log_index;
+    record->nice = proc->nice;
+    record->exit_status = proc->exit_status;
+    record->execution_time = proc->execution_time;
+    record->wait_time = proc->wait_time;
+    record->user_ms = proc->usage.ru_utime.tv_sec*1000 + proc->usage.ru_utime.tv_usec/1000;
+    record->system_ms = proc->usage.ru_stime.tv_sec*1000 + proc->usage.ru_stime.tv_usec/1000;
+    record->max_rss = proc->usage.ru_maxrss;
+    record->context_switches = proc->usage.ru_nvcsw + proc->usage.ru_nivcsw;
+    if (proc->completed && !record->completed){
+        record->end_ms = now_ms();
+        record->completed = true;
+    }
+}
+
+//adds a record to the pid index, the table is doubled when it gets half full
+//a record without a pid yet (a command that is being launched) is indexed once log_launched gives it one
+void index_insert(long record){
+    struct log_record *records = (struct log_record *)(log_map_header + 1);
+    if (record >= index_map_header->count){
+        index_map_header->count = record + 1;
+    }
+    if (records[record].pid <= 0){
+        return;
+    }
+    if (2 * (index_map_header->pids + 1) > index_map_header->buckets){
+        index_rebuild(2 * index_map_header->buckets);
+        return;
+    }
+    long *table = (long *)(index_map_header + 1);
+    int pid = records[record].pid;
+    long mask = index_map_header->buckets - 1;
+    long slot = ((unsigned long) pid * 2654435761UL) & mask;
+    while (table[slot] != -1 && records[table[slot]].pid != pid){
+        slot = (slot + 1) & mask;
+    }
+    if (table[slot] == -1){
+        index_map_header->pids++;
+    }
+    records[record].prev_same_pid = table[slot];
+    table[slot] = record;
+}
+
+//recreates the pid index with the given number of buckets from every record in the log
+void index_rebuild(long buckets){
+    long count = log_map_header->count;
+    while (buckets < 4 * count){
+        buckets *= 2;
+    }
+    log_map(index_fd, (void **) &index_map_header, &index_size, sizeof(struct index_header) + buckets * sizeof(long));
+    index_map_header->buckets = buckets;
+    index_map_header->pids = 0;
+    index_map_header->count = 0;
+    memset(index_map_header + 1, 0xff, buckets * sizeof(long));
+    for (long i=0; i<count; i++){
+        index_insert(i);
+    }
+}
+
+//newest record of a pid, older ones follow through prev_same_pid
+struct log_record *log_find_pid(int pid){
+    struct log_record *records = (struct log_record *)(log_map_header + 1);
+    long *table = (long *)(index_map_header + 1);
+    long mask = index_map_header->buckets - 1;
+    long slot = ((unsigned long) pid * 2654435761UL) & mask;
+    while (table[slot] != -1){
+        if (records[table[slot]].pid == pid){
+            return &records[table[slot]];
+        }
+        slot = (slot + 1) & mask;
+    }
+    return NULL;
+}
+
+//first record started at or after ms, records are appended in start time order
+long log_lower_bound(long ms){
+    struct log_record *records = (struct log_record *)(log_map_header + 1);
+    long low = 0, high = log_map_header->count;
+    while (low < high){
+        long mid = low + (high - low) / 2;
+        if (records[mid].start_ms < ms){
+            low = mid + 1;
+        }
+        else{
+            high = mid;
+        }
+    }
+    return low;
+}
+
+long now_ms(){
+    struct timeval now;
+    gettimeofday(&now, 0);
+    return now.tv_sec*1000 + now.tv_usec/1000;
+}
+
+void print_record(struct log_record *record){
+    time_t start = record->start_ms / 1000;
+    char when[32];
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&start));
+    printf("%s\t%d\t%s\t%s\t%ldms\t%ldms\n", when, record->pid, record->completed ? "done" : "-", record->command, record->execution_time, record->wait_time);
+}
+
+//history               : commands of this session
+//history -a            : every command in the log
+//history -p <pid>      : commands run with this pid, newest first
+//history -t <from> <to>: commands started in a range of epoch seconds
+//history -s <text>     : commands containing text
+int history_command(char *command){
+    log_refresh();
+    struct log_record *records = (struct log_record *)(log_map_header + 1);
+    char *option = strtok(command + 7, " ");
+    char *argument = strtok(NULL, "");
+    if (option == NULL){
+        //this session's commands, the command being run now is already logged
+        for (long i=log_session_first; i<log_map_header->count; i++){
+            if (records[i].session == session_id){
+                printf("%s\n", records[i].command);
+            }
+        }
+        return 1;
+    }
+    if (strcmp(option, "-a") == 0){
+        for (long i=0; i<log_map_header->count; i++){
+            print_record(&records[i]);
+        }
+        return 1;
+    }
+    if (argument == NULL){
+        printf("usage: history [-a|-p <pid>|-t <from> <to>|-s <text>]\n");
+        return 1;
+    }
+    if (strcmp(option, "-p") == 0){
+        int pid = atoi(argument);
+        for (struct log_record *record = log_find_pid(pid); record != NULL; record = record->prev_same_pid == -1 ? NULL : &records[record->prev_same_pid]){
+            print_record(record);
+        }
+    }
+    else if (strcmp(option, "-t") == 0){
+        char *end;
+        long from = strtol(argument, &end, 10), to = strtol(end, NULL, 10);
+        for (long i=log_lower_bound(from*1000); i<log_map_header->count && records[i].start_ms < to*1000; i++){
+            print_record(&records[i]);
+        }
+    }
+    else if (strcmp(option, "-s") == 0){
+        for (long i=0; i<log_map_header->count; i++){
+            if (strstr(records[i].command, argument) != NULL){
+                print_record(&records[i]);
+            }
+        }
+    }
+    else{
+        printf("usage: history [-a|-p <pid>|-t <from> <to>|-s <text>]\n");
+    }
+    return 1;
+}
+
+//registers this shell with the host-wide scheduler, starting the scheduler if none is running
+//the first shell creates the registry, later shells wait until it is initialised
+void attach_scheduler(){
+    registry_fd = shm_open(REGISTRY_NAME, O_CREAT|O_EXCL|O_RDWR, 0666);
+    bool created = registry_fd != -1;
+    if (!created){
+        registry_fd = shm_open(REGISTRY_NAME, O_RDWR, 0666);
+    }
+    if (registry_fd == -1){
+        perror("shm_open");
+        exit(1);
+    }
+    struct stat st;
+    for (int tries=0; !created && tries<100; tries++){
+        if (fstat(registry_fd, &st) == -1){
+            perror("fstat");
+            exit(1);
+        }
+        if (st.st_size == sizeof(struct registry)){
+            break;
+        }
+        usleep(10000);
+    }
+    if (ftruncate(registry_fd, sizeof(struct registry)) == -1){
+        perror("ftruncate");
+        exit(1);
+    }
+    registry = mmap(NULL, sizeof(struct registry), PROT_READ|PROT_WRITE, MAP_SHARED, registry_fd, 0);
+    if (registry == MAP_FAILED){
+        perror("mmap");
+        exit(1);
+    }
+    for (int tries=0; !created && !registry->ready && tries<100; tries++){
+        usleep(10000);
+    }
+    //a registry that never became ready or was left by an older build is set up again
+    if (created || !registry->ready || registry->magic != REGISTRY_MAGIC){
+        memset(registry, 0, sizeof(struct registry));
+        init_mutex(&registry->mutex);
+        registry->magic = REGISTRY_MAGIC;
+        registry->ready = true;
+    }
+
+    if (lock_mutex(&registry->mutex) == -1){
+        perror("pthread_mutex_lock");
+        exit(1);
+    }
+    int slot;
+    for (slot=0; slot<MAX_SESSIONS && registry->sessions[slot].shell_pid != 0; slot++);
+    if (slot == MAX_SESSIONS){
+        printf("%d shells are already attached to the scheduler\n", MAX_SESSIONS);
+        pthread_mutex_unlock(&registry->mutex);
+        shm_unlink(shm_name);
+        exit(1);
+    }
+    registry->sessions[slot].leaving = false;
+    registry->sessions[slot].shell_pid = getpid();
+    if (scheduler_alive()){
+        if (registry->ncpu != process_table->ncpu || registry->tslice != process_table->tslice){
+            printf("Attached to running scheduler with %d CPUs and %dms time quantum\n", registry->ncpu, registry->tslice);
+        }
+        else{
+            printf("Attached to running scheduler...\n");
+        }
+    }
+    else{
+        printf("Initializing simple scheduler...\n");
+        registry->ncpu = process_table->ncpu;
+        registry->tslice = process_table->tslice;
+        registry->auto_slots = auto_ncpu;
+        registry->workers = dispatch_workers;
+        launch_scheduler();
+    }
+    if ((errno = pthread_mutex_unlock(&registry->mutex)) != 0){
+        perror("pthread_mutex_unlock");
+        exit(1);
+    }
+}
+
+//starts the scheduler with the settings in the registry, called with the registry locked
+//it writes its own pid once it is a daemon, until then scheduler_pid is -1 so no other shell starts one too
+void launch_scheduler(){
+    pid_t pid;
+    if ((pid= fork())<0){
+        printf("fork() failed.\n");
+        perror("fork");
+        exit(1);
+    }
+    if (pid == 0){
+        if (execvp("./scheduler",("./scheduler",NULL)) == -1) {
+            printf("Couldn't initiate scheduler.\n");
+            exit(1);
+        }
+        exit(0);
+    }
+    registry->scheduler_pid = -1;
+    registry->launched = time(NULL);
+}
+
+//true while the scheduler runs or was started less than SCHEDULER_START_S seconds ago and has not written its pid yet
+bool scheduler_alive(){
+    int pid = registry->scheduler_pid;
+    if (pid == -1){
+        return time(NULL) - registry->launched < SCHEDULER_START_S;
+    }
+    return pid > 0 && (kill(pid, 0) == 0 || errno != ESRCH);
+}
+
+//restarts a scheduler that died, it takes over the queued jobs from the tables
+//the registry mutex is robust, so a scheduler that died holding it does not block the shells here
+void supervise_scheduler(){
+    if (registry == NULL || scheduler_alive()){
+        return;
+    }
+    if (lock_mutex(&registry->mutex) == -1){
+        perror("pthread_mutex_lock");
+        exit(1);
+    }
+    //another shell may have started it meanwhile
+    if (!scheduler_alive()){
+        printf("\nScheduler stopped, restarting it...\n");
+        launch_scheduler();
+    }
+    if ((errno = pthread_mutex_unlock(&registry->mutex)) != 0){
+        perror("pthread_mutex_unlock");
+        exit(1);
+    }
+}
+
+//initialises a mutex in shared memory, robust so that a process dying while it holds it does not block the others
+void init_mutex(pthread_mutex_t *mutex){
+    pthread_mutexattr_t attr;
+    int err = pthread_mutexattr_init(&attr);
+    if (err == 0){
+        err = pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    }
+    if (err == 0){
+        err = pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    }
+    if (err == 0){
+        err = pthread_mutex_init(mutex, &attr);
+    }
+    if (err != 0){
+        errno = err;
+        perror("pthread_mutex_init");
+        exit(1);
+    }
+    pthread_mutexattr_destroy(&attr);
+}
+
+//locks a shared mutex, returns -1 with errno set on failure
+//if its owner died holding it, the table may be half way through an update of a single entry, which is taken as it is
+int lock_mutex(pthread_mutex_t *mutex){
+    int err = pthread_mutex_lock(mutex);
+    if (err == EOWNERDEAD){
+        err = pthread_mutex_consistent(mutex);
+    }
+    if (err != 0){
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+//the table is shared with the scheduler, which may have died holding it
+int lock_table(){
+    return lock_mutex(&process_table->mutex);
+}
+
+int unlock_table(){
+    int err = pthread_mutex_unlock(&process_table->mutex);
+    if (err != 0){
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+//tells the scheduler this shell is leaving, it resumes the jobs it still holds for the shell
+void detach_scheduler(){
+    if (lock_mutex(&registry->mutex) == -1){
+        perror("pthread_mutex_lock");
+        exit(1);
+    }
+    for (int i=0; i<MAX_SESSIONS; i++){
+        if (registry->sessions[i].shell_pid == getpid()){
+            registry->sessions[i].leaving = true;
+        }
+    }
+    if ((errno = pthread_mutex_unlock(&registry->mutex)) != 0){
+        perror("pthread_mutex_unlock");
+        exit(1);
+    }
+    if (munmap(registry, sizeof(struct registry)) < 0){
+        perror("munmap");
+        exit(1);
+    }
+    registry = NULL;
+    if (close(registry_fd) == -1){
+        perror("close");
+        exit(1);
+    }
+}
+
+//number of cpus this shell may run on, from its affinity mask and capped by the quota in cgroup v2 cpu.max
+int host_cpus(){
+    cpu_set_t set;
+    int cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0){
+        cpus = CPU_COUNT(&set);
+    }
+    char line[4096], path[4200];
+    FILE *cgroup = fopen("/proc/self/cgroup", "r");
+    if (cgroup == NULL){
+        return cpus;
+    }
+    //the v2 hierarchy is the line starting with 0::
+    path[0] = '\0';
+    while (fgets(line, sizeof(line), cgroup) != NULL){
+        if (strncmp(line, "0::", 3) == 0){
+            line[strcspn(line, "\n")] = '\0';
+            snprintf(path, sizeof(path), "/sys/fs/cgroup%s/cpu.max", line + 3);
+        }
+    }
+    fclose(cgroup);
+    FILE *cpu_max = path[0] != '\0' ? fopen(path, "r") : NULL;
+    if (cpu_max == NULL){
+        return cpus;
+    }
+    long quota, period;
+    if (fscanf(cpu_max, "%ld %ld", &quota, &period) == 2 && period > 0){
+        int limit = (quota + period - 1) / period;
+        if (limit >= 1 && limit < cpus){
+            cpus = limit;
+        }
+    }
+    fclose(cpu_max);
+    return cpus;
 }
\ No newline at end of file